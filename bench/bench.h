@@ -0,0 +1,45 @@
+/*
+ * shared by the benchmarks: clocks and a typical request
+ */
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+# define HAVE_TSC 1
+#endif
+
+#define RUNS 5                      /* best of */
+
+/* firefox fetching an image it has cached already */
+static char typical[] =
+    "GET /docs/images/logo.png HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: image/avif,image/webp,image/png,image/svg+xml,image/*;q=0.8,*/*;q=0.5\r\n"
+    "Accept-Language: en-GB,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Referer: https://www.example.com/docs/index.html\r\n"
+    "Connection: keep-alive\r\n"
+    "If-Modified-Since: Tue, 01 Oct 2024 10:00:00 GMT\r\n"
+    "If-None-Match: \"1a2b3c-4d5e-6f7a8b\"\r\n"
+    "\r\n";
+
+static inline uint64_t
+nsecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* 0 if there is no cycle counter */
+static inline uint64_t
+cycles(void)
+{
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
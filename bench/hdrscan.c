@@ -0,0 +1,277 @@
+/*
+ * header scan benchmark: how fast does read_request() find the end of
+ * the request header?
+ *
+ *   old      strstr() for "\r\n\r\n" and "\n\n" over the whole buffer
+ *            after each read (webfsd up to 1.21)
+ *   new      header_end() from request.c: strstr(), new bytes only
+ *   memchr   new bytes only, line by line with memchr()
+ *   memmem   like new, with memmem()
+ *   sse2     like memchr, with a hand written SSE2 '\n' search
+ *   avx2     same with AVX2, if the cpu has it
+ *   pair     SSE2, finds '\n' followed by '\r' or '\n' in one pass
+ *
+ * for a header trickling in one byte per read(), a typical browser
+ * request in one read() and a 4k header in one read().
+ */
+#include "../request.c"
+#include "bench.h"
+
+typedef int (*scan_fn)(char *buf, int from, int len);
+
+/* ---------------------------------------------------------------------- */
+
+static int
+scan_old(char *buf, int from, int len)
+{
+    char *h;
+
+    if (NULL != (h = strstr(buf,"\r\n\r\n")) ||
+	NULL != (h = strstr(buf,"\n\n"))) {
+	if (*h == '\r') {
+	    h += 4;
+	    *(h-2) = 0;
+	} else {
+	    h += 2;
+	    *(h-1) = 0;
+	}
+	return h - buf;
+    }
+    return 0;
+}
+
+static int
+scan_new(char *buf, int from, int len)
+{
+    return header_end(buf,from,len);
+}
+
+/* line by line: stop at each '\n', look back for the blank line */
+#define SCAN_WITH(name, find)						\
+static int								\
+name(char *buf, int from, int len)					\
+{									\
+    char *h   = buf + (from ? from : 1);				\
+    char *end = buf + len;						\
+									\
+    while (NULL != (h = find(h, end))) {				\
+	if (h[-1] == '\n') {						\
+	    *h = 0;							\
+	} else if (h[-1] == '\r' && h - buf >= 2 && h[-2] == '\n') {	\
+	    h[-1] = 0;							\
+	} else {							\
+	    h++;							\
+	    continue;							\
+	}								\
+	return h+1 - buf;						\
+    }									\
+    return 0;								\
+}
+
+static inline char*
+find_memchr(char *p, char *end)
+{
+    return memchr(p, '\n', end - p);
+}
+SCAN_WITH(scan_memchr, find_memchr)
+
+#ifdef __SSE2__
+static inline char*
+find_sse2(char *p, char *end)
+{
+    __m128i nl = _mm_set1_epi8('\n');
+    int m;
+
+    for (; end - p >= 16; p += 16) {
+	m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)p),nl));
+	if (m)
+	    return p + __builtin_ctz(m);
+    }
+    for (; p < end; p++)
+	if (*p == '\n')
+	    return p;
+    return NULL;
+}
+SCAN_WITH(scan_sse2, find_sse2)
+
+__attribute__((target("avx2")))
+static inline char*
+find_avx2(char *p, char *end)
+{
+    __m256i nl = _mm256_set1_epi8('\n');
+    int m;
+
+    for (; end - p >= 32; p += 32) {
+	m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)p),nl));
+	if (m)
+	    return p + __builtin_ctz(m);
+    }
+    for (; p < end; p++)
+	if (*p == '\n')
+	    return p;
+    return NULL;
+}
+__attribute__((target("avx2")))
+SCAN_WITH(scan_avx2, find_avx2)
+
+/* look for '\n' followed by '\r' or '\n', stops at the blank line only */
+static int
+scan_pair(char *buf, int from, int len)
+{
+    __m128i nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+    __m128i a, b;
+    int i = from > 2 ? from-2 : 0, m, j;
+
+    for (; len - i >= 17; i += 16) {
+	a = _mm_loadu_si128((__m128i*)(buf+i));
+	b = _mm_loadu_si128((__m128i*)(buf+i+1));
+	m = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a,nl),
+					    _mm_or_si128(_mm_cmpeq_epi8(b,nl),
+							 _mm_cmpeq_epi8(b,cr))));
+	while (m) {
+	    j = i + __builtin_ctz(m);
+	    m &= m-1;
+	    if (buf[j+1] == '\n') {
+		buf[j+1] = 0;
+		return j+2;
+	    }
+	    if (j+2 < len && buf[j+2] == '\n') {
+		buf[j+1] = 0;
+		return j+3;
+	    }
+	}
+    }
+    for (; i < len-1; i++) {
+	if (buf[i] != '\n')
+	    continue;
+	if (buf[i+1] == '\n') {
+	    buf[i+1] = 0;
+	    return i+2;
+	}
+	if (buf[i+1] == '\r' && i+2 < len && buf[i+2] == '\n') {
+	    buf[i+1] = 0;
+	    return i+3;
+	}
+    }
+    return 0;
+}
+#endif
+
+static int
+scan_memmem(char *buf, int from, int len)
+{
+    int i = from > 2 ? from-2 : 0;
+    char *h;
+
+    if (NULL != (h = memmem(buf+i, len-i, "\n\r\n", 3))) {
+	h[1] = 0;
+	return h+3 - buf;
+    }
+    if (NULL != (h = memmem(buf+i, len-i, "\n\n", 2))) {
+	h[1] = 0;
+	return h+2 - buf;
+    }
+    return 0;
+}
+
+static struct {
+    char     *name;
+    scan_fn  scan;
+} scanners[] = {
+    { "old",    scan_old    },
+    { "new",    scan_new    },
+    { "memchr", scan_memchr },
+    { "memmem", scan_memmem },
+#ifdef __SSE2__
+    { "sse2",   scan_sse2   },
+    { "avx2",   scan_avx2   },
+    { "pair",   scan_pair   },
+#endif
+};
+#define NSCANNERS (sizeof(scanners)/sizeof(scanners[0]))
+
+/* ---------------------------------------------------------------------- */
+
+static char big[MAX_HEADER];
+
+/* the header comes in 'step' bytes per read(), 0: all at once */
+static void
+run(char *name, char *hdr, int step, long loops)
+{
+    static char buf[MAX_HEADER+1];
+    int len = strlen(hdr), hscan, hdata, n, i, r;
+    uint64_t t0, c0, t, c, best_t, best_c;
+    long l;
+
+    printf("%-8s %5d bytes, %s\n", name, len,
+	   step ? "one byte per read" : "one read");
+    for (i = 0; i < NSCANNERS; i++) {
+#ifdef __SSE2__
+	if (scanners[i].scan == scan_avx2 && !__builtin_cpu_supports("avx2"))
+	    continue;
+#endif
+	best_t = best_c = UINT64_MAX;
+	for (r = 0; r < RUNS; r++) {
+	    t0 = nsecs();
+	    c0 = cycles();
+	    for (l = 0; l < loops; l++) {
+		if (step) {
+		    /* like read_request(): hreq[hdata] = 0 after each read */
+		    for (hscan = 0, hdata = 0, n = 0; 0 == n; ) {
+			buf[hdata] = hdr[hdata];
+			buf[++hdata] = 0;
+			if (hdata < 5)
+			    continue;
+			if (0 == (n = scanners[i].scan(buf,hscan,hdata)))
+			    hscan = hdata;
+		    }
+		} else {
+		    if (0 == l) {
+			memcpy(buf,hdr,len+1);
+			hdata = len;
+		    }
+		    n = scanners[i].scan(buf,0,hdata);
+		    /* undo the terminating zero */
+		    buf[n-2] = '\r';
+		}
+		if (n != len) {
+		    fprintf(stderr,"%s: wrong header length %d\n",
+			    scanners[i].name,n);
+		    exit(1);
+		}
+	    }
+	    t = nsecs()  - t0;
+	    c = cycles() - c0;
+	    if (t < best_t)
+		best_t = t;
+	    if (c < best_c)
+		best_c = c;
+	}
+	printf("  %-8s %10.1f ns/header %8.2f bytes/ns", scanners[i].name,
+	       (double)best_t / loops, (double)len * loops / best_t);
+	if (best_c)
+	    printf(" %8.2f bytes/cycle (tsc)", (double)len * loops / best_c);
+	printf("\n");
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    char *p;
+    int len;
+
+    /* 4k: typical + a long cookie */
+    len = strlen(typical) - 2;
+    memcpy(big,typical,len);
+    p = big + len;
+    p += sprintf(p,"Cookie: session=");
+    for (; p - big < (int)sizeof(big) - 8; p++)
+	*p = 'a' + (p - big) % 26;
+    strcpy(p,"\r\n\r\n");
+
+    run("trickle", typical, 1,   20000);
+    run("typical", typical, 0, 2000000);
+    run("4k",      big,     0,  200000);
+    return 0;
+}
@@ -0,0 +1,78 @@
+#!/bin/bash
+#
+# directory listing benchmark: time the first (cold) listing of
+# directories with 10k, 100k and 1M entries.
+#
+# usage: bench/lsbench.sh [ entries ... ]
+#
+#   BIN=./webfsd     server to test
+#   OLD=             a second server to compare against, e.g. one built
+#                    from an older tree
+#   DIR=/tmp/webfsd-lsbench
+#                    where the test directories go, they are kept for
+#                    the next run (1M empty files need some inodes)
+#   PORT=18480
+#   RUNS=3           best of
+#
+# Each run starts a fresh server, so the listing is never in the
+# dircache.  The kernel's dentry and inode caches are dropped before
+# each run if /proc/sys/vm/drop_caches is writable (root), otherwise
+# they are warm and only the server side is measured.
+
+BIN="${BIN:-./webfsd}"
+DIR="${DIR:-/tmp/webfsd-lsbench}"
+PORT="${PORT:-18480}"
+RUNS="${RUNS:-3}"
+SIZES="${*:-10000 100000 1000000}"
+
+fill() {
+    local dir="$DIR/$1"
+
+    [ -f "$dir.done" ] && return
+    echo "creating $dir ..."
+    rm -rf "$dir"
+    mkdir -p "$dir" || exit 1
+    (cd "$dir" && seq -f "file-%07g.txt" 1 "$1" | xargs touch) || exit 1
+    touch "$dir.done"
+}
+
+# prints "first-byte total bytes" of the best run, in seconds
+cold() {
+    local bin="$1" size="$2" run pid out best=""
+
+    for run in $(seq 1 $RUNS); do
+	sync
+	[ -w /proc/sys/vm/drop_caches ] && echo 2 > /proc/sys/vm/drop_caches
+	"$bin" -F -p $PORT -r "$DIR" 2>/dev/null &
+	pid=$!
+	while ! curl -s -o /dev/null "http://127.0.0.1:$PORT/missing"; do
+	    kill -0 $pid 2>/dev/null || { echo "$bin: no server" >&2; exit 1; }
+	    sleep 0.1
+	done
+	out=$(curl -s -o /dev/null \
+		   -w '%{time_starttransfer} %{time_total} %{size_download}' \
+		   "http://127.0.0.1:$PORT/$size/")
+	kill $pid
+	wait $pid 2>/dev/null
+	if [ -z "$best" ] || \
+	    awk "BEGIN { exit !(${out%% *} < ${best%% *}) }"; then
+	    best="$out"
+	fi
+    done
+    echo "$best"
+}
+
+report() {
+    printf "  %-12s %9.1f ms first byte %9.1f ms total %11d bytes\n" \
+	"$1" $(echo "$2" | awk '{ print $1*1000, $2*1000, $3 }')
+}
+
+for size in $SIZES; do
+    fill $size
+done
+[ -w /proc/sys/vm/drop_caches ] || echo "not root, kernel caches stay warm"
+for size in $SIZES; do
+    echo "$size entries"
+    report "$(basename $BIN)" "$(cold "$BIN" $size)"
+    [ -n "$OLD" ] && report "old" "$(cold "$OLD" $size)"
+done
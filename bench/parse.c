@@ -0,0 +1,220 @@
+/*
+ * request parser benchmark: ns per request for the request line and
+ * header parsing in parse_request(), against the sscanf() based parser
+ * webfsd used up to 1.21 (kept here only).
+ *
+ * Both stop at the basic auth check (userpass is set, the requests
+ * don't authenticate), before any file system access.
+ */
+#include "../request.c"
+#include "bench.h"
+
+/* ---------------------------------------------------------------------- */
+/* the old parser, up to the auth check                                   */
+
+static void
+old_parse_request(struct REQUEST *req)
+{
+    char filename[MAX_PATH+1], proto[MAX_MISC+1], *h;
+    int  port;
+
+    /* parse request. Hehe, scanf is powerfull :-) */
+    if (4 != sscanf(req->hreq,
+		    "%" S(MAX_MISC) "[A-Z] "
+		    "%" S(MAX_PATH) "[^ \t\r\n] HTTP/%d.%d",
+		    req->type, filename, &(req->major),&(req->minor))) {
+	mkerror(req,400,0);
+	return;
+    }
+    if (filename[0] == '/') {
+	strcpy(req->uri,filename);    /* sscanf() limited it to MAX_PATH */
+    } else {
+	port = 0;
+	*proto = 0;
+	if (4 != sscanf(filename,
+			"%" S(MAX_MISC) "[a-zA-Z]://"
+			"%" S(MAX_HOST) "[a-zA-Z0-9.-]:%d"
+			"%" S(MAX_PATH) "[^ \t\r\n]",
+			proto, req->hostname, &port, req->uri) &&
+	    3 != sscanf(filename,
+			"%" S(MAX_MISC) "[a-zA-Z]://"
+			"%" S(MAX_HOST) "[a-zA-Z0-9.-]"
+			"%" S(MAX_PATH) "[^ \t\r\n]",
+			proto, req->hostname, req->uri)) {
+	    mkerror(req,400,0);
+	    return;
+	}
+	if (*proto != 0 && 0 != strcasecmp(proto,"http")) {
+	    mkerror(req,400,0);
+	    return;
+	}
+    }
+
+    unquote((unsigned char *)req->path,(unsigned char *)req->query,(unsigned char *)req->uri);
+    fixpath(req->path);
+
+    if (0 != strcmp(req->type,"GET") &&
+	0 != strcmp(req->type,"HEAD")) {
+	mkerror(req,501,0);
+	return;
+    }
+
+    if (0 == strcmp(req->type,"HEAD")) {
+	req->head_only = 1;
+    }
+
+    /* parse header lines */
+    req->keep_alive = req->minor;
+    for (h = req->hreq; h - req->hreq < req->lreq;) {
+	h = strchr(h,'\n');
+	if (NULL == h)
+	    break;
+	h++;
+
+	h[-2] = 0;
+	h[-1] = 0;
+	list_add(&req->header,h,0);
+
+	if (0 == strncasecmp(h,"Connection: ",12)) {
+	    req->keep_alive = (0 == strncasecmp(h+12,"Keep-Alive",10));
+
+	} else if (0 == strncasecmp(h,"Host: ",6)) {
+	    if (2 != sscanf(h+6,"%" S(MAX_HOST) "[a-zA-Z0-9.-]:%d",
+			    req->hostname,&port))
+		sscanf(h+6,"%" S(MAX_HOST) "[a-zA-Z0-9.-]",
+		       req->hostname);
+
+	} else if (0 == strncasecmp(h,"If-Modified-Since: ",19)) {
+	    req->if_modified = h+19;
+
+	} else if (0 == strncasecmp(h,"If-Unmodified-Since: ",21)) {
+	    req->if_unmodified = h+21;
+
+	} else if (0 == strncasecmp(h,"If-Range: ",10)) {
+	    req->if_range = h+10;
+
+	} else if (0 == strncasecmp(h,"Authorization: Basic ",21)) {
+	    decode_base64((unsigned char *)req->auth,(unsigned char *)(h+21),sizeof(req->auth)-1);
+
+	} else if (0 == strncasecmp(h,"Range: bytes=",13)) {
+	    req->range_hdr = h+13;
+	}
+    }
+
+    /* take care about the hostname */
+    if (req->hostname[0] == '\0' || canonicalhost)
+	strncpy(req->hostname,server_host,MAX_HOST);
+
+    /* checks */
+    if (0 != sanity_checks(req))
+	return;
+
+    /* check basic auth */
+    if (NULL != userpass && 0 != strcmp(userpass,req->auth)) {
+	mkerror(req,401,1);
+	return;
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+
+static void
+nop_parse_request(struct REQUEST *req)
+{
+}
+
+static struct {
+    char  *name;
+    void  (*parse)(struct REQUEST *req);
+} parsers[] = {
+    { "copy", nop_parse_request },  /* setup only, included below */
+    { "old",  old_parse_request },
+    { "new",  parse_request     },
+};
+#define NPARSERS (sizeof(parsers)/sizeof(parsers[0]))
+
+static char minimal[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "\r\n";
+
+static char absolute[] =
+    "GET http://www.example.com:8080/a%20b/c.html?x=1 HTTP/1.1\r\n"
+    "Host: www.example.com:8080\r\n"
+    "Range: bytes=0-1023\r\n"
+    "Authorization: Basic Ym9iOnNlY3JldA==\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static struct REQUEST req;
+static struct REQBUF  rbuf;
+
+/* what read_request() would have left behind */
+static void
+setup(char *hdr, int len)
+{
+    list_free(&req.header);
+    req.header        = NULL;
+    req.auth[0]       = 0;
+    req.hostname[0]   = 0;
+    req.if_modified   = NULL;
+    req.if_unmodified = NULL;
+    req.if_range      = NULL;
+    req.if_match      = NULL;
+    req.if_none_match = NULL;
+    req.range_hdr     = NULL;
+    req.accept_enc    = 0;
+    req.ls_format     = LS_HTML;
+    req.head_only     = 0;
+    req.status        = 0;
+    memcpy(req.hreq,hdr,len+1);
+    req.hreq[len-2] = 0;
+    req.lreq  = len;
+    req.hdata = len;
+}
+
+static void
+run(char *name, char *hdr, long loops)
+{
+    int len = strlen(hdr), i, r;
+    uint64_t t0, t, best;
+    long l;
+
+    printf("%-8s %5d bytes\n", name, len);
+    for (i = 0; i < NPARSERS; i++) {
+	best = UINT64_MAX;
+	for (r = 0; r < RUNS; r++) {
+	    t0 = nsecs();
+	    for (l = 0; l < loops; l++) {
+		setup(hdr,len);
+		parsers[i].parse(&req);
+	    }
+	    t = nsecs() - t0;
+	    if (t < best)
+		best = t;
+	}
+	if (parsers[i].parse != nop_parse_request && 401 != req.status) {
+	    fprintf(stderr,"%s: status %d, expected 401\n",
+		    parsers[i].name,req.status);
+	    exit(1);
+	}
+	printf("  %-8s %8.1f ns/request\n", parsers[i].name,
+	       (double)best / loops);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    req.hreq  = rbuf.hreq;
+    req.hres  = rbuf.hres;
+    req.uri   = rbuf.uri;
+    req.path  = rbuf.path;
+    req.query = rbuf.query;
+    userpass  = "nobody:nothing";
+
+    run("minimal",  minimal,  1000000);
+    run("typical",  typical,  1000000);
+    run("absolute", absolute, 1000000);
+    return 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * just enough of the rest of webfsd to link request.c into the
+ * benchmarks, nothing here does any work
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "../httpd.h"
+
+int    debug;
+int    virtualhosts;
+int    canonicalhost;
+int    do_chroot;
+int    no_listing;
+int    fcache_max;
+char   *indexhtml = "index.html";
+char   *cgipath;
+char   *doc_root = ".";
+char   server_host[256] = "localhost";
+char   *userpass;
+char   *userdir;
+#ifdef USE_SSL
+int    with_ssl;
+
+int ssl_read(struct REQUEST *req, char *buf, int len) { return -1; }
+#endif
+
+void  xperror(int loglevel, char *txt, char *peerhost) {}
+char  *req_peerhost(struct REQUEST *req) { return "-"; }
+int   http_date(char *buf, time_t t) { buf[0] = 0; return 0; }
+time_t parse_date(char *p) { return 0; }
+void  fcache_encode(struct REQUEST *req) {}
+struct FCACHE* fcache_get(char *path) { return NULL; }
+void  fcache_release(struct FCACHE *f) {}
+void  fcache_close(struct REQUEST *req) {}
+void  mkerror(struct REQUEST *req, int status, int ka) { req->status = status; }
+void  mkredirect(struct REQUEST *req) {}
+void  mkheader(struct REQUEST *req, int status) { req->status = status; }
+int   mketag(char *buf, struct stat *st, char *encoding, int weak) { return 0; }
+struct DIRCACHE *get_dir(struct REQUEST *req, char *filename) { return NULL; }
+void  ls_body(struct REQUEST *req) {}
+int   ls_start(struct REQUEST *req, int offset, int limit) { return -1; }
+char* get_mime(char *file) { return "text/plain"; }
+void  cgi_request(struct REQUEST *req) {}
+int   ev_result(struct REQUEST *req) { return -1; }
@@ -136,7 +136,7 @@ cgi_request(struct REQUEST *req)
     env_add(&env,"GATEWAY_INTERFACE","CGI/1.1");
     env_add(&env,"QUERY_STRING",req->query);
     env_add(&env,"REQUEST_URI",req->uri);
-    env_add(&env,"REMOTE_ADDR",req->peerhost);
+    env_add(&env,"REMOTE_ADDR",req_peerhost(req));
     env_add(&env,"REMOTE_PORT",req->peerserv);
     env_add(&env,"REQUEST_METHOD",req->type);
     env_add(&env,"SERVER_ADMIN","root@localhost");
@@ -0,0 +1,240 @@
+/*
+ * time formatting and parsing -- the strings for the current second are cached
+ * (per thread), so building response headers and log lines just
+ * copies bytes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "httpd.h"
+
+static const char wdays[7][4] = {
+    "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+};
+static const char months[12][4] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+static THREAD_LOCAL time_t  http_t = -1;
+static THREAD_LOCAL char    http_buf[DATE_LEN+1];
+static THREAD_LOCAL time_t  clf_t = -1;
+static THREAD_LOCAL char    clf_buf[CLF_LEN+1];
+
+/* ---------------------------------------------------------------------- */
+
+static inline char*
+put2(char *p, int n)
+{
+    p[0] = '0' + n / 10;
+    p[1] = '0' + n % 10;
+    return p+2;
+}
+
+static inline char*
+put4(char *p, int n)
+{
+    p = put2(p, n / 100 % 100);
+    return put2(p, n % 100);
+}
+
+static inline char*
+put3(char *p, const char *s)
+{
+    p[0] = s[0];
+    p[1] = s[1];
+    p[2] = s[2];
+    return p+3;
+}
+
+/* RFC 1123 date, same as strftime(RFC1123) in the C locale */
+int
+http_date(char *buf, time_t t)
+{
+    struct tm tm;
+    char *p = buf;
+
+    gmtime_r(&t,&tm);
+    p = put3(p,wdays[tm.tm_wday]);
+    *(p++) = ',';
+    *(p++) = ' ';
+    p = put2(p,tm.tm_mday);
+    *(p++) = ' ';
+    p = put3(p,months[tm.tm_mon]);
+    *(p++) = ' ';
+    p = put4(p,tm.tm_year + 1900);
+    *(p++) = ' ';
+    p = put2(p,tm.tm_hour);
+    *(p++) = ':';
+    p = put2(p,tm.tm_min);
+    *(p++) = ':';
+    p = put2(p,tm.tm_sec);
+    memcpy(p," GMT",5);
+    return DATE_LEN;
+}
+
+/* RFC 1123 date for now */
+char*
+http_now(void)
+{
+    if (http_t != now) {
+	http_date(http_buf,now);
+	http_t = now;
+    }
+    return http_buf;
+}
+
+/* common log format timestamp for now, "[10/Oct/2000:13:55:36 -0700]" */
+char*
+clf_now(void)
+{
+    struct tm tm;
+    long off;
+    char *p = clf_buf;
+
+    if (clf_t == now)
+	return clf_buf;
+
+    localtime_r(&now,&tm);
+    off = tm.tm_gmtoff / 60;
+    *(p++) = '[';
+    p = put2(p,tm.tm_mday);
+    *(p++) = '/';
+    p = put3(p,months[tm.tm_mon]);
+    *(p++) = '/';
+    p = put4(p,tm.tm_year + 1900);
+    *(p++) = ':';
+    p = put2(p,tm.tm_hour);
+    *(p++) = ':';
+    p = put2(p,tm.tm_min);
+    *(p++) = ':';
+    p = put2(p,tm.tm_sec);
+    *(p++) = ' ';
+    *(p++) = (off < 0) ? '-' : '+';
+    if (off < 0)
+	off = -off;
+    p = put2(p,off / 60 % 100);
+    p = put2(p,off % 60);
+    *(p++) = ']';
+    *p = 0;
+    clf_t = now;
+    return clf_buf;
+}
+
+/* ---------------------------------------------------------------------- */
+
+static int
+get_num(char **p, int digits)
+{
+    int value = -1;
+
+    for (; digits > 0 && **p >= '0' && **p <= '9'; digits--, (*p)++)
+	value = (value < 0 ? 0 : value * 10) + **p - '0';
+    return value;
+}
+
+static int
+get_month(char **p)
+{
+    int i;
+
+    for (i = 0; i < 12; i++) {
+	if (0 == strncmp(*p,months[i],3)) {
+	    *p += 3;
+	    return i;
+	}
+    }
+    return -1;
+}
+
+static int
+get_time(char **p, int *hour, int *min, int *sec)
+{
+    *hour = get_num(p,2);
+    if (**p != ':')
+	return -1;
+    (*p)++;
+    *min = get_num(p,2);
+    if (**p != ':')
+	return -1;
+    (*p)++;
+    *sec = get_num(p,2);
+    return 0;
+}
+
+/* days since 1970-01-01 of a proleptic gregorian date */
+static long
+days_from_civil(long y, int m, int d)
+{
+    long era, yoe, doy;
+
+    y -= (m <= 2);
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+/*
+ * Parse a HTTP date, all three formats from RFC 9110:
+ *   Sun, 06 Nov 1994 08:49:37 GMT    (RFC 1123)
+ *   Sunday, 06-Nov-94 08:49:37 GMT   (RFC 850)
+ *   Sun Nov  6 08:49:37 1994         (asctime)
+ * Returns -1 if it isn't one.
+ */
+time_t
+parse_date(char *p)
+{
+    int mday, mon, year, hour, min, sec;
+
+    /* skip weekday */
+    while ((*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z'))
+	p++;
+    if (*p == ',')
+	p++;
+    if (*p != ' ')
+	return -1;
+    p++;
+
+    if (*p >= '0' && *p <= '9') {
+	mday = get_num(&p,2);
+	if (*p != ' ' && *p != '-')
+	    return -1;
+	p++;
+	mon = get_month(&p);
+	if (*p != ' ' && *p != '-')
+	    return -1;
+	p++;
+	year = get_num(&p,4);
+	if (*p != ' ')
+	    return -1;
+	p++;
+	if (-1 == get_time(&p,&hour,&min,&sec) || 0 != strncmp(p," GMT",4))
+	    return -1;
+	if (year >= 0 && year < 100)
+	    /* RFC 850 two-digit year */
+	    year += (year < 70) ? 2000 : 1900;
+    } else {
+	mon = get_month(&p);
+	while (*p == ' ')
+	    p++;
+	mday = get_num(&p,2);
+	if (*p != ' ')
+	    return -1;
+	p++;
+	if (-1 == get_time(&p,&hour,&min,&sec) || *p != ' ')
+	    return -1;
+	p++;
+	year = get_num(&p,4);
+    }
+    if (mon < 0 || mday < 1 || mday > 31 || year < 1970 ||
+	hour < 0 || hour > 23 || min < 0 || min > 59 || sec < 0 || sec > 60)
+	return -1;
+    return (time_t)days_from_civil(year,mon+1,mday) * 86400 +
+	hour * 3600 + min * 60 + sec;
+}
@@ -0,0 +1,950 @@
+/*
+ * event loop backends: tell mainloop() which connections are ready
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include "httpd.h"
+
+#if defined(__linux__) && !defined(NO_EPOLL)
+# include <sys/epoll.h>
+# define HAVE_EPOLL 1
+#endif
+
+#if defined(__linux__) && !defined(NO_URING) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <stdint.h>
+#  include <poll.h>
+#  include <endian.h>
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  include <linux/io_uring.h>
+#  if defined(__NR_io_uring_setup) && defined(IORING_FEAT_EXT_ARG)
+#   define HAVE_URING 1
+#  endif
+# endif
+#endif
+
+#define EV_BATCH 256
+
+/* ---------------------------------------------------------------------- */
+
+/* which fd / events does a request in its current state wait for? */
+static void
+ev_interest(struct REQUEST *req, int *sock, int *pipe)
+{
+    *sock = 0;
+    *pipe = 0;
+    switch (req->state) {
+    case STATE_KEEPALIVE:
+    case STATE_READ_HEADER:
+	*sock = EV_READ;
+	break;
+    case STATE_WRITE_HEADER:
+    case STATE_WRITE_BODY:
+    case STATE_WRITE_FILE:
+    case STATE_WRITE_RANGES:
+    case STATE_WRITE_LISTING:
+    case STATE_CGI_BODY_OUT:
+	*sock = EV_WRITE;
+#ifdef USE_SSL
+	if (with_ssl)
+	    *sock |= EV_READ;
+#endif
+	break;
+    case STATE_CGI_HEADER:
+    case STATE_CGI_BODY_IN:
+	*pipe = EV_READ;
+	break;
+#ifdef USE_SSL
+    case STATE_TLS_HANDSHAKE:
+	*sock = req->ssl_want;
+	break;
+#endif
+    }
+}
+
+/* other threads poked us (ev_wake), the work they hand back is
+   picked up by mainloop() once ev_wait() returns */
+static void
+ev_drain(struct EVLOOP *loop)
+{
+    char buf[64];
+
+    while (read(loop->wakefd[0],buf,sizeof(buf)) > 0)
+	;
+}
+
+static int
+ev_grow(struct EVLOOP *loop, int count)
+{
+    struct EVENT *ready;
+
+    if (count <= loop->max_ready)
+	return 0;
+    ready = realloc(loop->ready, count * sizeof(struct EVENT));
+    if (NULL == ready)
+	return -1;
+    loop->ready = ready;
+    loop->max_ready = count;
+    return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+/* select() -- portable, rebuilds the fd sets from the connection list    */
+
+static int
+select_update(struct EVLOOP *loop, struct REQUEST *req, int sock, int pipe)
+{
+    if ((sock && req->fd >= FD_SETSIZE) ||
+	(pipe && req->cgipipe >= FD_SETSIZE)) {
+	xerror(LOG_WARNING,"select: fd out of range",req_peerhost(req));
+	return -1;
+    }
+    return 0;
+}
+
+static int
+select_wait(struct EVLOOP *loop, int timeout)
+{
+    struct REQUEST  *req;
+    struct timeval  tv;
+    fd_set          rd,wr;
+    int             max,sock,pipe,flags,n;
+
+    FD_ZERO(&rd);
+    FD_ZERO(&wr);
+    max = 0;
+    if (loop->listening) {
+	FD_SET(loop->slisten,&rd);
+	max = loop->slisten;
+    }
+    if (-1 != loop->wakefd[0]) {
+	FD_SET(loop->wakefd[0],&rd);
+	if (loop->wakefd[0] > max)
+	    max = loop->wakefd[0];
+    }
+    for (req = loop->conns; req != NULL; req = req->next) {
+	ev_interest(req,&sock,&pipe);
+	if (sock & EV_READ)
+	    FD_SET(req->fd,&rd);
+	if (sock & EV_WRITE)
+	    FD_SET(req->fd,&wr);
+	if (sock && req->fd > max)
+	    max = req->fd;
+	if (pipe) {
+	    FD_SET(req->cgipipe,&rd);
+	    if (req->cgipipe > max)
+		max = req->cgipipe;
+	}
+    }
+
+    tv.tv_sec  = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    if (-1 == select(max+1,&rd,&wr,NULL,(timeout >= 0) ? &tv : NULL))
+	return -1;
+
+    if (-1 != loop->wakefd[0] && FD_ISSET(loop->wakefd[0],&rd))
+	ev_drain(loop);
+    if (-1 == ev_grow(loop, loop->nconns+1))
+	return -1;
+    n = 0;
+    if (loop->listening && FD_ISSET(loop->slisten,&rd)) {
+	loop->ready[n].req   = NULL;
+	loop->ready[n].fd    = -1;
+	loop->ready[n].flags = EV_READ;
+	n++;
+    }
+    for (req = loop->conns; req != NULL; req = req->next) {
+	ev_interest(req,&sock,&pipe);
+	flags = 0;
+	if ((sock & EV_READ)  && FD_ISSET(req->fd,&rd))
+	    flags |= EV_READ;
+	if ((sock & EV_WRITE) && FD_ISSET(req->fd,&wr))
+	    flags |= EV_WRITE;
+	if (pipe && FD_ISSET(req->cgipipe,&rd))
+	    flags |= EV_READ;
+	if (!flags)
+	    continue;
+	loop->ready[n].req   = req;
+	loop->ready[n].fd    = -1;
+	loop->ready[n].flags = flags;
+	n++;
+    }
+    return n;
+}
+
+/* ---------------------------------------------------------------------- */
+/* epoll() -- linux, interest is registered once and changed on demand    */
+
+#ifdef HAVE_EPOLL
+
+static int
+epoll_mask(int flags)
+{
+    return ((flags & EV_READ)  ? EPOLLIN  : 0) |
+	   ((flags & EV_WRITE) ? EPOLLOUT : 0);
+}
+
+static int
+epoll_change(struct EVLOOP *loop, int fd, void *ptr, int old, int new)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (old == new)
+	return 0;
+    if (!new)
+	op = EPOLL_CTL_DEL;
+    else if (!old)
+	op = EPOLL_CTL_ADD;
+    else
+	op = EPOLL_CTL_MOD;
+    memset(&ev,0,sizeof(ev));
+    ev.events   = epoll_mask(new);
+    ev.data.ptr = ptr;
+    if (-1 == epoll_ctl(loop->efd,op,fd,&ev)) {
+	xperror(LOG_WARNING,"epoll_ctl",NULL);
+	return -1;
+    }
+    return 0;
+}
+
+static int
+epoll_update(struct EVLOOP *loop, struct REQUEST *req, int sock, int pipe)
+{
+    if (-1 == epoll_change(loop,req->fd,req,req->ev_sock,sock))
+	return -1;
+    req->ev_sock = sock;
+    if (-1 == epoll_change(loop,req->cgipipe,req,req->ev_pipe,pipe))
+	return -1;
+    req->ev_pipe = pipe;
+    return 0;
+}
+
+static int
+epoll_wait_ready(struct EVLOOP *loop, int timeout)
+{
+    struct epoll_event evs[EV_BATCH];
+    int i,n,m,flags;
+
+    m = epoll_wait(loop->efd,evs,EV_BATCH,timeout);
+    if (-1 == m)
+	return -1;
+    if (-1 == ev_grow(loop, EV_BATCH))
+	return -1;
+    for (i = 0, n = 0; i < m; i++) {
+	if (evs[i].data.ptr == (void*)loop->wakefd) {
+	    ev_drain(loop);
+	    continue;
+	}
+	flags = 0;
+	if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+	    flags |= EV_READ;
+	if (evs[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+	    flags |= EV_WRITE;
+	loop->ready[n].req   = evs[i].data.ptr;
+	loop->ready[n].fd    = -1;
+	loop->ready[n].flags = flags;
+	n++;
+    }
+    return n;
+}
+
+#endif /* HAVE_EPOLL */
+
+/* ---------------------------------------------------------------------- */
+/* io_uring -- linux 5.11+, everything is submitted in one batch per loop */
+/* iteration together with the wait for completions:                      */
+/*   - accepts, as many as we have room for connections (up to 16),       */
+/*   - header reads (recv) into the request buffer, and writes (sendmsg)  */
+/*     of responses which are in memory, header and body in one go,       */
+/*   - oneshot polls for everything else (TLS, files, cgi, keep-alive).   */
+/* read_request() / write_request() pick up the result via ev_result().   */
+
+#ifdef HAVE_URING
+
+#define UD_SOCK    0    /* poll/io on req->fd */
+#define UD_PIPE    1    /* poll on req->cgipipe */
+#define UD_LISTEN  2    /* accept on the listening socket */
+#define UD_IGNORE  3    /* cancel requests */
+#define UD_WAKE    4    /* poll on the wakeup pipe */
+#define UD_UNLISTEN 5   /* cancel an accept */
+#define UD_MASK    7    /* requests come from a pool, 16 byte aligned */
+
+#define EV_CANCEL  4    /* slot: cancel request in flight */
+#define EV_IO      16   /* slot: recv/sendmsg instead of a poll */
+
+#define URING_ACCEPTS 16
+
+struct URING {
+    int                  fd;
+    unsigned             sq_entries;
+    unsigned             *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned             *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe  *sqes;
+    struct io_uring_cqe  *cqes;
+    void                 *sq_ring, *cq_ring;
+    size_t               sq_ring_size, cq_ring_size, sqes_size;
+
+    int                  accepts;    /* in flight */
+    int                  unlisten;   /* accept cancels in flight */
+    int                  wake;       /* poll on wakefd armed */
+};
+
+static int
+uring_enter(struct URING *u, unsigned submit, unsigned wait, unsigned flags,
+	    void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, u->fd, submit, wait, flags, arg, argsz);
+}
+
+static unsigned
+uring_queued(struct URING *u)
+{
+    return *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static struct io_uring_sqe*
+uring_sqe(struct URING *u)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail, idx;
+
+    if (uring_queued(u) >= u->sq_entries) {
+	/* ring full -- push out what we have */
+	if (-1 == uring_enter(u, uring_queued(u), 0, 0, NULL, 0) ||
+	    uring_queued(u) >= u->sq_entries) {
+	    xperror(LOG_WARNING,"io_uring_enter",NULL);
+	    return NULL;
+	}
+    }
+    tail = *u->sq_tail;
+    idx  = tail & *u->sq_mask;
+    sqe  = &u->sqes[idx];
+    memset(sqe,0,sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail+1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+static int
+uring_poll_add(struct URING *u, int fd, int flags, uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+    uint32_t mask;
+
+    if (NULL == (sqe = uring_sqe(u)))
+	return -1;
+    mask = ((flags & EV_READ)  ? POLLIN  : 0) |
+	   ((flags & EV_WRITE) ? POLLOUT : 0);
+#if __BYTE_ORDER == __BIG_ENDIAN
+    mask = (mask << 16) | (mask >> 16);
+#endif
+    sqe->opcode       = IORING_OP_POLL_ADD;
+    sqe->fd           = fd;
+    sqe->poll32_events = mask;
+    sqe->user_data    = data;
+    return 0;
+}
+
+static int
+uring_cancel(struct URING *u, int opcode, uint64_t data, uint64_t tag)
+{
+    struct io_uring_sqe *sqe;
+
+    if (NULL == (sqe = uring_sqe(u)))
+	return -1;
+    sqe->opcode    = opcode;
+    sqe->fd        = -1;
+    sqe->addr      = data;
+    sqe->user_data = tag;
+    return 0;
+}
+
+/* can the ring do the next read/write of the request itself? */
+static int
+uring_io(struct REQUEST *req)
+{
+#ifdef USE_SSL
+    if (with_ssl)
+	return 0;
+#endif
+    switch (req->state) {
+    case STATE_READ_HEADER:
+	return NULL != req->buf && req->hdata < MAX_HEADER;
+    case STATE_WRITE_HEADER:
+	/* the writev() case of write_request() */
+	return NULL != req->body && !req->head_only;
+    case STATE_WRITE_BODY:
+	return 1;
+    }
+    return 0;
+}
+
+static int
+uring_recv(struct URING *u, struct REQUEST *req, uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+
+    if (NULL == (sqe = uring_sqe(u)))
+	return -1;
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = req->fd;
+    sqe->addr      = (uintptr_t)(req->hreq + req->hdata);
+    sqe->len       = MAX_HEADER - req->hdata;
+    sqe->user_data = data;
+    return 0;
+}
+
+/* same iovecs write_request() would use, they must stay put until
+   the completion arrives */
+static int
+uring_send(struct URING *u, struct REQUEST *req, uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+
+    if (NULL == (sqe = uring_sqe(u)))
+	return -1;
+    memset(&req->ev_msg,0,sizeof(req->ev_msg));
+    req->ev_msg.msg_iov = req->ev_iov;
+    if (STATE_WRITE_HEADER == req->state) {
+	req->ev_iov[0].iov_base = req->hres + req->written;
+	req->ev_iov[0].iov_len  = req->lres - req->written;
+	req->ev_iov[1].iov_base = req->body;
+	req->ev_iov[1].iov_len  = req->lbody;
+	req->ev_msg.msg_iovlen  = 2;
+    } else {
+	req->ev_iov[0].iov_base = req->body + req->written;
+	req->ev_iov[0].iov_len  = req->lbody - req->written;
+	req->ev_msg.msg_iovlen  = 1;
+    }
+    sqe->opcode    = IORING_OP_SENDMSG;
+    sqe->fd        = req->fd;
+    sqe->addr      = (uintptr_t)&req->ev_msg;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = data;
+    return 0;
+}
+
+/* keep as many accepts in flight as we have room for connections */
+static void
+uring_arm_listen(struct EVLOOP *loop)
+{
+    struct URING *u = loop->uring;
+    struct io_uring_sqe *sqe;
+    int want = 0;
+
+    if (loop->listening)
+	want = loop->room < URING_ACCEPTS ? loop->room : URING_ACCEPTS;
+    while (u->accepts < want) {
+	if (NULL == (sqe = uring_sqe(u)))
+	    return;
+	sqe->opcode       = IORING_OP_ACCEPT;
+	sqe->fd           = loop->slisten;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data    = UD_LISTEN;
+	u->accepts++;
+    }
+    if (0 == want) {
+	/* leave new connections in the listen queue */
+	while (u->unlisten < u->accepts) {
+	    if (-1 == uring_cancel(u, IORING_OP_ASYNC_CANCEL,
+				   UD_LISTEN, UD_UNLISTEN))
+		return;
+	    u->unlisten++;
+	}
+    }
+}
+
+static int
+uring_slot(struct URING *u, struct REQUEST *req, int *slot, int fd,
+	   int tag, int want)
+{
+    uint64_t data = (uintptr_t)req | tag;
+    int rc;
+
+    if (*slot & EV_CANCEL)
+	/* wait for the completion, will be re-armed then */
+	return 0;
+    if (*slot == want)
+	return 0;
+    if (0 == *slot) {
+	if (!(want & EV_IO))
+	    rc = uring_poll_add(u, fd, want, data);
+	else if (want & EV_READ)
+	    rc = uring_recv(u, req, data);
+	else
+	    rc = uring_send(u, req, data);
+	if (-1 == rc)
+	    return -1;
+	*slot = want;
+	return 0;
+    }
+    /* armed with the wrong mask */
+    if (-1 == uring_cancel(u, (*slot & EV_IO) ? IORING_OP_ASYNC_CANCEL
+			   : IORING_OP_POLL_REMOVE, data, UD_IGNORE))
+	return -1;
+    *slot |= EV_CANCEL;
+    return 0;
+}
+
+static int
+uring_update(struct EVLOOP *loop, struct REQUEST *req, int sock, int pipe)
+{
+    struct URING *u = loop->uring;
+
+    if (sock && uring_io(req))
+	sock |= EV_IO;
+    if (-1 == uring_slot(u,req,&req->ev_sock,req->fd,UD_SOCK,sock))
+	return -1;
+    if (-1 == uring_slot(u,req,&req->ev_pipe,req->cgipipe,UD_PIPE,pipe))
+	return -1;
+    return 0;
+}
+
+static void
+uring_ready(struct EVLOOP *loop, int *n, struct REQUEST *req, int fd, int flags)
+{
+    if (NULL != req && req->ev_index) {
+	/* already queued in this batch */
+	loop->ready[req->ev_index-1].flags |= flags;
+	return;
+    }
+    loop->ready[*n].req   = req;
+    loop->ready[*n].fd    = fd;
+    loop->ready[*n].flags = flags;
+    (*n)++;
+    if (NULL != req)
+	req->ev_index = *n;
+}
+
+static int
+uring_wait(struct EVLOOP *loop, int timeout)
+{
+    struct URING *u = loop->uring;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    struct io_uring_cqe *cqe;
+    struct REQUEST *req;
+    unsigned head,tail;
+    int i,n,rc,tag,slot,flags;
+
+    uring_arm_listen(loop);
+    if (-1 != loop->wakefd[0] && !u->wake &&
+	0 == uring_poll_add(u, loop->wakefd[0], EV_READ, UD_WAKE))
+	u->wake = 1;
+
+    memset(&arg,0,sizeof(arg));
+    if (timeout >= 0) {
+	ts.tv_sec  = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000;
+	arg.ts = (uintptr_t)&ts;
+    }
+    head = *u->cq_head;
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    rc = uring_enter(u, uring_queued(u), (head == tail) ? 1 : 0,
+		     IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+		     &arg, sizeof(arg));
+    if (-1 == rc && ETIME != errno)
+	return -1;
+
+    n = 0;
+    head = *u->cq_head;
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    /* at most one event per completion.  Make room first, the
+       completions stay in the ring if we can't -- once consumed an
+       accepted fd or a poll result would be lost */
+    if (-1 == ev_grow(loop, tail - head))
+	return -1;
+    for (; head != tail; head++) {
+	cqe = &u->cqes[head & *u->cq_mask];
+	tag = cqe->user_data & UD_MASK;
+	req = (struct REQUEST*)(uintptr_t)(cqe->user_data & ~(uint64_t)UD_MASK);
+	switch (tag) {
+	case UD_IGNORE:
+	    break;
+	case UD_WAKE:
+	    u->wake = 0;
+	    ev_drain(loop);
+	    break;
+	case UD_UNLISTEN:
+	    u->unlisten--;
+	    break;
+	case UD_LISTEN:
+	    u->accepts--;
+	    if (cqe->res >= 0) {
+		uring_ready(loop, &n, NULL, cqe->res, EV_READ);
+	    } else if (-ECANCELED != cqe->res && -EINTR != cqe->res &&
+		       -EAGAIN != cqe->res && -ECONNABORTED != cqe->res) {
+		errno = -cqe->res;
+		xperror(LOG_WARNING,"accept",NULL);
+	    }
+	    break;
+	case UD_SOCK:
+	case UD_PIPE:
+	    if (UD_SOCK == tag) {
+		slot = req->ev_sock;
+		req->ev_sock = 0;
+	    } else {
+		slot = req->ev_pipe;
+		req->ev_pipe = 0;
+	    }
+	    if (STATE_CLOSE == req->state) {
+		/* closed while requests were pending */
+		if (0 == req->ev_sock && 0 == req->ev_pipe)
+		    uring_ready(loop, &n, req, -1, EV_RELEASE);
+		break;
+	    }
+	    flags = 0;
+	    if (slot & EV_IO) {
+		if (-ECANCELED != cqe->res) {
+		    /* done, the request picks it up via ev_result() */
+		    req->ev_done = 1;
+		    req->ev_res  = cqe->res;
+		    flags = slot & (EV_READ | EV_WRITE);
+		}
+	    } else {
+		if (cqe->res > 0 && (cqe->res & (POLLIN | POLLHUP | POLLERR)))
+		    flags |= EV_READ;
+		if (cqe->res > 0 && (cqe->res & (POLLOUT | POLLHUP | POLLERR)))
+		    flags |= EV_WRITE;
+	    }
+	    /* deliver even without flags, so the request gets re-armed */
+	    uring_ready(loop, &n, req, -1, flags);
+	    break;
+	}
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+    for (i = 0; i < n; i++)
+	if (loop->ready[i].req)
+	    loop->ready[i].req->ev_index = 0;
+    return n;
+}
+
+static int
+uring_forget(struct EVLOOP *loop, struct REQUEST *req)
+{
+    struct URING *u = loop->uring;
+    int io = 0;
+
+    if (req->ev_sock && !(req->ev_sock & EV_CANCEL)) {
+	io = req->ev_sock & EV_IO;
+	uring_cancel(u, io ? IORING_OP_ASYNC_CANCEL : IORING_OP_POLL_REMOVE,
+		     (uintptr_t)req | UD_SOCK, UD_IGNORE);
+	req->ev_sock |= EV_CANCEL;
+    }
+    if (req->ev_pipe && !(req->ev_pipe & EV_CANCEL)) {
+	uring_cancel(u, IORING_OP_POLL_REMOVE, (uintptr_t)req | UD_PIPE,
+		     UD_IGNORE);
+	req->ev_pipe |= EV_CANCEL;
+    }
+    if (io)
+	/* submit now, before the caller closes the fd: a recv queued
+	   for it must not pick up a new connection reusing the number */
+	uring_enter(u, uring_queued(u), 0, 0, NULL, 0);
+    return (req->ev_sock || req->ev_pipe) ? 1 : 0;
+}
+
+static void
+uring_free(struct EVLOOP *loop)
+{
+    struct URING *u = loop->uring;
+
+    if (NULL == u)
+	return;
+    if (u->sqes && MAP_FAILED != (void*)u->sqes)
+	munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring && MAP_FAILED != u->cq_ring && u->cq_ring != u->sq_ring)
+	munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring && MAP_FAILED != u->sq_ring)
+	munmap(u->sq_ring, u->sq_ring_size);
+    if (-1 != u->fd)
+	close(u->fd);
+    free(u);
+    loop->uring = NULL;
+}
+
+static int
+uring_init(struct EVLOOP *loop)
+{
+    struct io_uring_params p;
+    struct URING *u;
+    unsigned cq;
+
+    if (NULL == (u = malloc(sizeof(*u))))
+	return -1;
+    memset(u,0,sizeof(*u));
+    loop->uring  = u;
+
+    /* one poll or io per connection may be pending, size the cq for it */
+    for (cq = 4096; cq < (unsigned)max_conn * 2 && cq < 65536; cq <<= 1)
+	;
+    memset(&p,0,sizeof(p));
+    p.flags      = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    p.cq_entries = cq;
+    u->fd = syscall(__NR_io_uring_setup, 1024, &p);
+    if (-1 == u->fd)
+	goto err;
+    if (!(p.features & IORING_FEAT_EXT_ARG) ||
+	!(p.features & IORING_FEAT_NODROP) ||
+	!(p.features & IORING_FEAT_FAST_POLL)) {
+	errno = ENOSYS;
+	goto err;
+    }
+    fcntl(u->fd,F_SETFD,FD_CLOEXEC);
+
+    u->sq_entries   = p.sq_entries;
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	if (u->cq_ring_size > u->sq_ring_size)
+	    u->sq_ring_size = u->cq_ring_size;
+	u->cq_ring_size = u->sq_ring_size;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == u->sq_ring)
+	goto err;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	u->cq_ring = u->sq_ring;
+    } else {
+	u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	if (MAP_FAILED == u->cq_ring)
+	    goto err;
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (MAP_FAILED == (void*)u->sqes)
+	goto err;
+
+    u->sq_head  = (unsigned*)((char*)u->sq_ring + p.sq_off.head);
+    u->sq_tail  = (unsigned*)((char*)u->sq_ring + p.sq_off.tail);
+    u->sq_mask  = (unsigned*)((char*)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*)((char*)u->sq_ring + p.sq_off.array);
+    u->cq_head  = (unsigned*)((char*)u->cq_ring + p.cq_off.head);
+    u->cq_tail  = (unsigned*)((char*)u->cq_ring + p.cq_off.tail);
+    u->cq_mask  = (unsigned*)((char*)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes     = (struct io_uring_cqe*)((char*)u->cq_ring + p.cq_off.cqes);
+    if (debug)
+	fprintf(stderr,"io_uring: sq %u, cq %u entries\n",
+		p.sq_entries, p.cq_entries);
+    return 0;
+
+ err:
+    xperror(LOG_WARNING,"io_uring_setup",NULL);
+    uring_free(loop);
+    return -1;
+}
+
+#endif /* HAVE_URING */
+
+/* ---------------------------------------------------------------------- */
+
+char *ev_engine_name(struct EVLOOP *loop)
+{
+    switch (loop->engine) {
+    case ENGINE_EPOLL:  return "epoll";
+    case ENGINE_URING:  return "uring";
+    default:            return "select";
+    }
+}
+
+int
+ev_init(struct EVLOOP *loop, int slisten)
+{
+    memset(loop,0,sizeof(*loop));
+    loop->slisten = slisten;
+    loop->efd     = -1;
+    loop->engine  = ENGINE_SELECT;
+    loop->wakefd[0] = -1;
+    loop->wakefd[1] = -1;
+
+#ifdef HAVE_URING
+    if (NULL != engine && 0 == strcmp(engine,"uring")) {
+	if (0 == uring_init(loop))
+	    loop->engine = ENGINE_URING;
+	else
+	    xerror(LOG_WARNING,"io_uring not available (trying epoll)",NULL);
+    }
+#endif
+#ifdef HAVE_EPOLL
+    if (ENGINE_SELECT == loop->engine &&
+	(NULL == engine || 0 != strcmp(engine,"select"))) {
+	loop->efd = epoll_create1(EPOLL_CLOEXEC);
+	if (-1 != loop->efd)
+	    loop->engine = ENGINE_EPOLL;
+	else
+	    xperror(LOG_WARNING,"epoll_create1 (using select)",NULL);
+    }
+#endif
+    if (NULL != engine && 0 != strcmp(engine,ev_engine_name(loop)) &&
+	0 != strcmp(engine,"uring")) {
+	xerror(LOG_WARNING,"event engine not available",NULL);
+    }
+    if (debug)
+	fprintf(stderr,"event engine: %s\n",ev_engine_name(loop));
+    return 0;
+}
+
+void
+ev_free(struct EVLOOP *loop)
+{
+    if (-1 != loop->efd)
+	close(loop->efd);
+    if (-1 != loop->wakefd[0]) {
+	close(loop->wakefd[0]);
+	close(loop->wakefd[1]);
+    }
+#ifdef HAVE_URING
+    uring_free(loop);
+#endif
+    free(loop->ready);
+    loop->ready = NULL;
+    loop->max_ready = 0;
+}
+
+/* arm/disarm the listening socket, room: connections we may accept */
+void
+ev_listen(struct EVLOOP *loop, int room)
+{
+    int on = room > 0;
+
+    loop->room = room;
+    if (loop->listening == on)
+	return;
+    loop->listening = on;
+#ifdef HAVE_EPOLL
+    if (ENGINE_EPOLL == loop->engine)
+	epoll_change(loop,loop->slisten,NULL,!on ? EV_READ : 0,on ? EV_READ : 0);
+#endif
+}
+
+/* let other threads interrupt ev_wait(), see ev_wake() */
+int
+ev_wakeup(struct EVLOOP *loop)
+{
+    if (-1 == pipe(loop->wakefd)) {
+	xperror(LOG_WARNING,"pipe",NULL);
+	loop->wakefd[0] = -1;
+	loop->wakefd[1] = -1;
+	return -1;
+    }
+    fcntl(loop->wakefd[0],F_SETFD,FD_CLOEXEC);
+    fcntl(loop->wakefd[1],F_SETFD,FD_CLOEXEC);
+    fcntl(loop->wakefd[0],F_SETFL,O_NONBLOCK);
+    fcntl(loop->wakefd[1],F_SETFL,O_NONBLOCK);
+#ifdef HAVE_EPOLL
+    if (ENGINE_EPOLL == loop->engine)
+	epoll_change(loop,loop->wakefd[0],loop->wakefd,0,EV_READ);
+#endif
+    return 0;
+}
+
+/* may be called from any thread; a full pipe means there is a
+   wakeup pending already */
+void
+ev_wake(struct EVLOOP *loop)
+{
+    char c = 0;
+
+    if (-1 == write(loop->wakefd[1],&c,1) && EAGAIN != errno)
+	xperror(LOG_WARNING,"wakeup",NULL);
+}
+
+/* sync registered interest with req->state, -1 if the request can't
+   be handled by the event engine */
+int
+ev_update(struct EVLOOP *loop, struct REQUEST *req)
+{
+    int sock,pipe;
+
+    ev_interest(req,&sock,&pipe);
+    switch (loop->engine) {
+#ifdef HAVE_URING
+    case ENGINE_URING:
+	return uring_update(loop,req,sock,pipe);
+#endif
+#ifdef HAVE_EPOLL
+    case ENGINE_EPOLL:
+	return epoll_update(loop,req,sock,pipe);
+#endif
+    default:
+	return select_update(loop,req,sock,pipe);
+    }
+}
+
+/* 1 if the event engine does the next write of the request itself,
+   the caller should not write() but wait for the event */
+int
+ev_sends(struct EVLOOP *loop, struct REQUEST *req)
+{
+#ifdef HAVE_URING
+    if (ENGINE_URING == loop->engine && 0 == req->ev_sock)
+	return uring_io(req);
+#endif
+    return 0;
+}
+
+/* read()/write() return value of the I/O the engine did for us */
+int
+ev_result(struct REQUEST *req)
+{
+    req->ev_done = 0;
+    if (req->ev_res >= 0)
+	return req->ev_res;
+    errno = -req->ev_res;
+    return -1;
+}
+
+/* drop all registrations, must be called before closing fds.
+   Returns 1 if the engine still holds references to the request,
+   it will be handed back with EV_RELEASE once it is safe to free. */
+int
+ev_forget(struct EVLOOP *loop, struct REQUEST *req)
+{
+    switch (loop->engine) {
+#ifdef HAVE_URING
+    case ENGINE_URING:
+	return uring_forget(loop,req);
+#endif
+#ifdef HAVE_EPOLL
+    case ENGINE_EPOLL:
+	epoll_update(loop,req,0,0);
+	break;
+#endif
+    default:
+	break;
+    }
+    return 0;
+}
+
+/* wait for events (timeout in ms, -1 = forever), fills loop->ready */
+int
+ev_wait(struct EVLOOP *loop, int timeout)
+{
+    switch (loop->engine) {
+#ifdef HAVE_URING
+    case ENGINE_URING:
+	return uring_wait(loop,timeout);
+#endif
+#ifdef HAVE_EPOLL
+    case ENGINE_EPOLL:
+	return epoll_wait_ready(loop,timeout);
+#endif
+    default:
+	return select_wait(loop,timeout);
+    }
+}
@@ -0,0 +1,633 @@
+/*
+ * open file cache -- keeps fd, stat data, mime type and Last-Modified
+ * of recently served files, shared by all threads.  Entries are
+ * revalidated with stat() every fcache_valid seconds; failed lookups
+ * (ENOENT, EACCES) are cached the same way.
+ *
+ * Small files are read into memory instead (up to mcache_max bytes
+ * total), their file handle is closed right away.
+ *
+ * With zlib (and zstd) compressible files are compressed on the first
+ * request by a background thread, the result is kept with the entry
+ * (up to zcache_max bytes total).  Until it is done the file goes out
+ * uncompressed.  Never on the event loop: without threads (or if the
+ * thread can't be started) files are always sent uncompressed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#ifdef USE_ZLIB
+# include <zlib.h>
+#endif
+#ifdef USE_ZSTD
+# include <zstd.h>
+#endif
+
+#include "httpd.h"
+
+#define ZCACHE_MIN    256            /* don't bother below */
+#define ZCACHE_FILE   (4*1024*1024)  /* max. file size compressed on the fly */
+
+#ifdef USE_THREADS
+static pthread_mutex_t lock_fcache = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static struct FCACHE   **buckets;
+static unsigned int    nbuckets;
+static int             count;
+static off_t           mbytes;                 /* file data in memory */
+static off_t           zbytes;                 /* compressed data */
+static struct FCACHE   *lru_head, *lru_tail;   /* head: most recent */
+static unsigned long   hits, misses, evictions, stale;
+static unsigned long   zhits, zdone;
+
+#if defined(USE_ZLIB) && defined(USE_THREADS)
+struct ZJOB {
+    struct FCACHE      *f;
+    int                z;
+    struct ZJOB        *next;
+};
+
+static struct ZJOB     *zjobs, *zjobs_tail;
+static pthread_cond_t  zjobs_cond = PTHREAD_COND_INITIALIZER;
+static int             zthread;
+#endif
+
+#if defined(USE_ZLIB) && defined(USE_THREADS)
+static struct ZVARIANT {
+    char *name;
+    int  flag;
+} zvariants[FCACHE_ZVARIANTS] = {
+    /* in order of preference */
+    { "zstd", ENC_ZSTD },
+    { "gzip", ENC_GZIP },
+};
+#endif
+
+/* ---------------------------------------------------------------------- */
+
+static unsigned int
+hash_path(char *path)
+{
+    unsigned int h = 2166136261u;    /* FNV-1a */
+
+    for (; *path; path++) {
+	h ^= (unsigned char)*path;
+	h *= 16777619u;
+    }
+    return h;
+}
+
+static void
+lru_unlink(struct FCACHE *f)
+{
+    if (f->prev)
+	f->prev->next = f->next;
+    else
+	lru_head = f->next;
+    if (f->next)
+	f->next->prev = f->prev;
+    else
+	lru_tail = f->prev;
+    f->prev = f->next = NULL;
+}
+
+static void
+lru_push(struct FCACHE *f)
+{
+    f->prev = NULL;
+    f->next = lru_head;
+    if (lru_head)
+	lru_head->prev = f;
+    lru_head = f;
+    if (NULL == lru_tail)
+	lru_tail = f;
+}
+
+static void
+fcache_put(struct FCACHE *f)
+{
+    if (--f->refcount > 0)
+	return;
+    if (f->fd != -1)
+	close(f->fd);
+    free(f->data);
+    free(f->zdata[0]);
+    free(f->zdata[1]);
+    free(f);
+}
+
+/* drop from the cache, in-flight requests keep their reference */
+static void
+fcache_remove(struct FCACHE *f)
+{
+    struct FCACHE **p;
+
+    for (p = &buckets[f->hash & (nbuckets-1)]; *p; p = &(*p)->hnext) {
+	if (*p == f) {
+	    *p = f->hnext;
+	    break;
+	}
+    }
+    lru_unlink(f);
+    f->cached = 0;
+    count--;
+    if (f->data)
+	mbytes -= f->st.st_size;
+    zbytes -= f->zlen[0] + f->zlen[1];
+    fcache_put(f);
+}
+
+static struct FCACHE*
+fcache_find(char *path, unsigned int hash)
+{
+    struct FCACHE *f;
+
+    for (f = buckets[hash & (nbuckets-1)]; f; f = f->hnext)
+	if (f->hash == hash && 0 == strcmp(f->path,path))
+	    return f;
+    return NULL;
+}
+
+/* the header lines which depend on the file only */
+static void
+fcache_mkhead(struct FCACHE *f)
+{
+    char date[DATE_LEN+1];
+    char etag[ETAG_LEN];
+
+    mketag(etag,&f->st,NULL,0);
+    f->lhead = snprintf(f->head, sizeof(f->head),
+			"Content-Type: %s\r\n"
+			"Content-Length: %" PRId64 "\r\n"
+			"ETag: %s\r\n"
+			"Last-Modified: %s\r\n",
+			f->mime, (int64_t)f->st.st_size, etag, f->mtime);
+    if (-1 != lifespan) {
+	http_date(date,f->st.st_mtime + lifespan);
+	f->lhead += snprintf(f->head + f->lhead, sizeof(f->head) - f->lhead,
+			     "Expires: %s\r\n",date);
+    }
+    if (f->lhead >= (int)sizeof(f->head))
+	/* silly long mime type, mkheader() will do it */
+	f->lhead = 0;
+}
+
+/* slurp a small file, the caller closes the file handle then */
+static int
+fcache_load(struct FCACHE *f)
+{
+    off_t pos;
+    ssize_t rc;
+
+    if (NULL == (f->data = malloc(f->st.st_size ? f->st.st_size : 1)))
+	return -1;
+    for (pos = 0; pos < f->st.st_size; pos += rc) {
+	rc = pread(f->fd, f->data + pos, f->st.st_size - pos, pos);
+	if (rc <= 0) {
+	    free(f->data);
+	    f->data = NULL;
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/* evict least recently used entries until we fit, called locked */
+static void
+fcache_shrink(void)
+{
+    while (lru_tail && (count > fcache_max || mbytes > mcache_max ||
+			zbytes > zcache_max)) {
+	evictions++;
+	fcache_remove(lru_tail);
+    }
+}
+
+static int
+same_file(struct stat *a, struct stat *b)
+{
+    return a->st_ino   == b->st_ino   &&
+	   a->st_dev   == b->st_dev   &&
+	   a->st_size  == b->st_size  &&
+	   a->st_mtime == b->st_mtime;
+}
+
+/* ---------------------------------------------------------------------- */
+
+void
+init_fcache(void)
+{
+    if (fcache_max <= 0)
+	return;
+    for (nbuckets = 16; nbuckets < (unsigned int)fcache_max; nbuckets <<= 1)
+	;
+    buckets = calloc(nbuckets, sizeof(struct FCACHE*));
+    if (NULL == buckets) {
+	xerror(LOG_WARNING,"oom: file cache disabled",NULL);
+	fcache_max = 0;
+    }
+}
+
+/*
+ * Returns a referenced entry, or NULL with errno set.  Pass the entry
+ * to fcache_release() when done.
+ */
+struct FCACHE*
+fcache_get(char *path)
+{
+    struct FCACHE *f,*old;
+    struct stat st;
+    unsigned int hash;
+    int revalidate,fd,err;
+
+    hash = hash_path(path);
+    DO_LOCK(lock_fcache);
+    f = fcache_find(path,hash);
+    if (f) {
+	revalidate = (now - f->checked >= fcache_valid);
+	if (revalidate)
+	    /* one thread checks, the others keep using the entry */
+	    f->checked = now;
+	f->refcount++;
+	hits++;
+	if (lru_head != f) {
+	    lru_unlink(f);
+	    lru_push(f);
+	}
+	DO_UNLOCK(lock_fcache);
+
+	if (revalidate) {
+	    if (-1 == stat(path,&st)
+		? (0 == f->err || errno != f->err)
+		: (0 != f->err || !same_file(&st,&f->st))) {
+		/* changed on disk */
+		DO_LOCK(lock_fcache);
+		hits--;
+		stale++;
+		if (f->cached)
+		    fcache_remove(f);
+		fcache_put(f);
+		DO_UNLOCK(lock_fcache);
+		goto miss;
+	    }
+	}
+	if (f->err) {
+	    err = f->err;
+	    fcache_release(f);
+	    errno = err;
+	    return NULL;
+	}
+	return f;
+    }
+    DO_UNLOCK(lock_fcache);
+
+ miss:
+    /* open outside the lock */
+    err = 0;
+    if (-1 == (fd = open(path,O_RDONLY))) {
+	err = errno;
+	if (ENOENT != err && EACCES != err && ENOTDIR != err)
+	    /* don't cache EMFILE & friends */
+	    return NULL;
+    } else {
+	close_on_exec(fd);
+	fstat(fd,&st);
+    }
+    if (NULL == (f = malloc(sizeof(*f) + strlen(path)+1))) {
+	if (-1 != fd)
+	    close(fd);
+	errno = err ? err : ENOMEM;
+	return NULL;
+    }
+    memset(f,0,sizeof(*f));
+    f->path    = (char*)(f+1);
+    strcpy(f->path,path);
+    f->hash    = hash;
+    f->fd      = fd;
+    f->err     = err;
+    f->checked = now;
+    if (-1 != fd) {
+	f->st   = st;
+	f->mime = get_mime(path);
+	http_date(f->mtime,st.st_mtime);
+	if (S_ISREG(st.st_mode)) {
+	    fcache_mkhead(f);
+	    if (st.st_size <= FCACHE_SMALL && st.st_size <= mcache_max &&
+		0 == fcache_load(f)) {
+		close(fd);
+		f->fd = -1;
+	    }
+	}
+    }
+    f->refcount = 2;                 /* cache + caller */
+    f->cached   = 1;
+
+    DO_LOCK(lock_fcache);
+    misses++;
+    if (NULL != (old = fcache_find(path,hash)))
+	/* raced with another thread, newer entry wins */
+	fcache_remove(old);
+    f->hnext = buckets[hash & (nbuckets-1)];
+    buckets[hash & (nbuckets-1)] = f;
+    lru_push(f);
+    count++;
+    if (f->data)
+	mbytes += st.st_size;
+    fcache_shrink();
+    DO_UNLOCK(lock_fcache);
+
+    if (debug)
+	fprintf(stderr,"fcache: add %s (%s)\n",path,
+		err ? strerror(err) : f->data ? "in memory" : "ok");
+    if (err) {
+	fcache_release(f);
+	errno = err;
+	return NULL;
+    }
+    return f;
+}
+
+void
+fcache_release(struct FCACHE *f)
+{
+    DO_LOCK(lock_fcache);
+    fcache_put(f);
+    DO_UNLOCK(lock_fcache);
+}
+
+/* close the body file of a request, cached or not */
+void
+fcache_close(struct REQUEST *req)
+{
+    if (req->fc) {
+	fcache_release(req->fc);
+	req->fc = NULL;
+    } else if (req->bfd != -1) {
+	close(req->bfd);
+    }
+    req->bfd = -1;
+}
+
+/* ---------------------------------------------------------------------- */
+/* compression on the fly                                                 */
+
+#if defined(USE_ZLIB) && defined(USE_THREADS)
+
+static int
+compressible(char *mime)
+{
+    static char *types[] = {
+	"application/javascript", "application/json", "application/xml",
+	"application/wasm", "image/svg+xml", NULL
+    };
+    int i, len;
+
+    if (0 == strncmp(mime,"text/",5))
+	return 1;
+    len = strlen(mime);
+    if ((len > 5 && 0 == strcmp(mime+len-5,"+json")) ||
+	(len > 4 && 0 == strcmp(mime+len-4,"+xml")))
+	return 1;
+    for (i = 0; types[i]; i++)
+	if (0 == strcmp(mime,types[i]))
+	    return 1;
+    return 0;
+}
+
+static char*
+compress_gzip(char *src, size_t len, size_t *zlen)
+{
+    z_stream zs;
+    char *dst;
+    size_t max;
+
+    memset(&zs,0,sizeof(zs));
+    if (Z_OK != deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+			     15 + 16 /* gzip wrapper */, 8, Z_DEFAULT_STRATEGY))
+	return NULL;
+    max = deflateBound(&zs,len);
+    if (NULL != (dst = malloc(max))) {
+	zs.next_in   = (Bytef*)src;
+	zs.avail_in  = len;
+	zs.next_out  = (Bytef*)dst;
+	zs.avail_out = max;
+	if (Z_STREAM_END != deflate(&zs,Z_FINISH)) {
+	    free(dst);
+	    dst = NULL;
+	}
+	*zlen = zs.total_out;
+    }
+    deflateEnd(&zs);
+    return dst;
+}
+
+#ifdef USE_ZSTD
+static char*
+compress_zstd(char *src, size_t len, size_t *zlen)
+{
+    char *dst;
+    size_t max;
+
+    max = ZSTD_compressBound(len);
+    if (NULL == (dst = malloc(max)))
+	return NULL;
+    *zlen = ZSTD_compress(dst,max,src,len,3);
+    if (ZSTD_isError(*zlen)) {
+	free(dst);
+	return NULL;
+    }
+    return dst;
+}
+#endif
+
+/* build variant z, called unlocked with a reference held */
+static void
+fcache_compress(struct FCACHE *f, int z)
+{
+    char *src, *dst = NULL;
+    size_t len = f->st.st_size, zlen = 0;
+    ssize_t rc;
+    off_t pos;
+
+    src = f->data;
+    if (NULL == src) {
+	if (NULL == (src = malloc(len)))
+	    goto done;
+	for (pos = 0; pos < len; pos += rc) {
+	    rc = pread(f->fd, src + pos, len - pos, pos);
+	    if (rc <= 0)
+		goto done;
+	}
+    }
+    switch (zvariants[z].flag) {
+    case ENC_GZIP:
+	dst = compress_gzip(src,len,&zlen);
+	break;
+#ifdef USE_ZSTD
+    case ENC_ZSTD:
+	dst = compress_zstd(src,len,&zlen);
+	break;
+#endif
+    }
+    if (dst && zlen >= len) {
+	/* no gain */
+	free(dst);
+	dst = NULL;
+    }
+    if (debug)
+	fprintf(stderr,"fcache: %s %s: %" PRId64 " => %" PRId64 "\n",
+		zvariants[z].name, f->path, (int64_t)len, (int64_t)zlen);
+
+ done:
+    if (src != f->data)
+	free(src);
+    DO_LOCK(lock_fcache);
+    zdone++;
+    if (dst && f->cached && zlen <= zcache_max) {
+	f->zdata[z]  = dst;
+	f->zlen[z]   = zlen;
+	f->zstate[z] = ZSTATE_DONE;
+	zbytes += zlen;
+	fcache_shrink();
+    } else {
+	free(dst);
+	f->zstate[z] = ZSTATE_FAILED;
+    }
+    fcache_put(f);
+    DO_UNLOCK(lock_fcache);
+}
+
+static void*
+fcache_compressor(void *arg)
+{
+    struct ZJOB *job;
+
+    for (;;) {
+	DO_LOCK(lock_fcache);
+	while (NULL == zjobs)
+	    WAIT_COND(zjobs_cond,lock_fcache);
+	job = zjobs;
+	zjobs = job->next;
+	if (NULL == zjobs)
+	    zjobs_tail = NULL;
+	DO_UNLOCK(lock_fcache);
+
+	fcache_compress(job->f,job->z);
+	free(job);
+    }
+    return NULL;
+}
+
+#endif /* USE_ZLIB && USE_THREADS */
+
+/* start the compressor thread, call this after fork() */
+void
+fcache_start(void)
+{
+#if defined(USE_ZLIB) && defined(USE_THREADS)
+    pthread_t t;
+
+    if (zcache_max <= 0)
+	return;
+    if (0 != pthread_create(&t,NULL,fcache_compressor,NULL)) {
+	xperror(LOG_WARNING,"start compressor",NULL);
+	return;
+    }
+    pthread_detach(t);
+    zthread = 1;
+#endif
+}
+
+/*
+ * Send the compressed variant of the file if we have one.  Otherwise
+ * queue the compression and send the file as-is this time.
+ */
+void
+fcache_encode(struct REQUEST *req)
+{
+#if defined(USE_ZLIB) && defined(USE_THREADS)
+    struct FCACHE *f = req->fc;
+    struct ZJOB *job;
+    int z;
+
+    if (!zthread || NULL == f || !S_ISREG(f->st.st_mode) ||
+	f->st.st_size < ZCACHE_MIN || f->st.st_size > ZCACHE_FILE ||
+	!compressible(f->mime))
+	return;
+    /* compressed now or later, depending on Accept-Encoding */
+    req->vary = 1;
+    for (z = 0; z < FCACHE_ZVARIANTS; z++) {
+	if (!(req->accept_enc & zvariants[z].flag))
+	    continue;
+#ifndef USE_ZSTD
+	if (ENC_ZSTD == zvariants[z].flag)
+	    continue;
+#endif
+	DO_LOCK(lock_fcache);
+	switch (f->zstate[z]) {
+	case ZSTATE_DONE:
+	    zhits++;
+	    req->body     = f->zdata[z];
+	    req->lbody    = f->zlen[z];
+	    req->encoding = zvariants[z].name;
+	    DO_UNLOCK(lock_fcache);
+	    return;
+	case ZSTATE_FAILED:
+	    DO_UNLOCK(lock_fcache);
+	    continue;
+	case ZSTATE_NONE:
+	    if (!f->cached)
+		break;
+	    /* we are first, everybody else finds it pending */
+	    if (NULL == (job = malloc(sizeof(*job))))
+		/* stay in ZSTATE_NONE, retry next time */
+		break;
+	    f->zstate[z] = ZSTATE_PENDING;
+	    f->refcount++;
+	    job->f    = f;
+	    job->z    = z;
+	    job->next = NULL;
+	    if (zjobs_tail)
+		zjobs_tail->next = job;
+	    else
+		zjobs = job;
+	    zjobs_tail = job;
+	    BCAST_COND(zjobs_cond);
+	    break;
+	}
+	DO_UNLOCK(lock_fcache);
+	return;
+    }
+#endif
+}
+
+void
+fcache_stats(void)
+{
+    char msg[256];
+    int len;
+
+    if (fcache_max <= 0)
+	return;
+    DO_LOCK(lock_fcache);
+    len = snprintf(msg,sizeof(msg),"file cache: %d/%d entries, %" PRId64
+		   " kB data, %lu hits, %lu misses, %lu stale, %lu evictions",
+		   count,fcache_max,(int64_t)mbytes/1024,
+		   hits,misses,stale,evictions);
+    if (zcache_max > 0)
+	snprintf(msg+len,sizeof(msg)-len,", %" PRId64 " kB compressed, "
+		 "%lu compressed, %lu compressed hits",
+		 (int64_t)zbytes/1024,zdone,zhits);
+    DO_UNLOCK(lock_fcache);
+    xerror(LOG_NOTICE,msg,NULL);
+}
@@ -1,6 +1,9 @@
 #include <sys/stat.h>
 #ifdef USE_THREADS
 # include <pthread.h>
+# define THREAD_LOCAL __thread
+#else
+# define THREAD_LOCAL
 #endif
 
 #define STATE_READ_HEADER   1
@@ -9,6 +12,7 @@
 #define STATE_WRITE_BODY    4
 #define STATE_WRITE_FILE    5
 #define STATE_WRITE_RANGES  6
+#define STATE_WRITE_LISTING 15
 #define STATE_FINISHED      7
 
 #define STATE_KEEPALIVE     8
@@ -18,6 +22,10 @@
 #define STATE_CGI_BODY_IN  11
 #define STATE_CGI_BODY_OUT 12
 
+#define STATE_TLS_HANDSHAKE 13       /* waiting for the peer */
+#define STATE_TLS_OFFLOAD   14       /* on a handshake thread */
+#define STATE_LS_SCAN       16       /* directory read by a scan thread */
+
 #ifdef USE_SSL
 # include <openssl/ssl.h>
 #endif
@@ -27,18 +35,33 @@
 #define MAX_HOST     64
 #define MAX_MISC     16
 #define BR_HEADER   512
+#define ETAG_LEN     80              /* W/"ino-size-mtime-encoding" */
 
 #define S1(str) #str
 #define S(str)  S1(str)
 
 #define RFC1123	"%a, %d %b %Y %H:%M:%S GMT"
 
+#define ENC_GZIP     1               /* Accept-Encoding */
+#define ENC_BR       2
+#define ENC_ZSTD     4
+
+#define LS_HTML      0               /* directory listing formats */
+#define LS_JSON      1
+#define LS_NDJSON    2
+#define LS_FORMATS   3
+
 struct DIRCACHE {
-    char             path[1024];
+    char             *path;
+    unsigned int     hash;
     char             mtime[40];
     time_t           add;
-    char             *html;
-    int              length;
+    char             *page[LS_FORMATS]; /* NULL: not yet / streamed */
+    int              length[LS_FORMATS];
+    struct myfile    **files;         /* sorted index */
+    char             *arena;          /* the entries */
+    int              count;           /* -1: can't read the directory */
+    size_t           size;            /* memory used */
 
 #ifdef USE_THREADS
     pthread_mutex_t  lock_refcount;
@@ -47,7 +70,15 @@ struct DIRCACHE {
 #endif
     int              refcount;
     int              reading;
-
+    int              cached;          /* still in the hash table */
+    int              charged;         /* bytes counted in the shard */
+    int              wd;              /* inotify watch, -1 if none */
+    int              dirty;           /* directory changed */
+    struct REQUEST   *waiting;        /* parked until reading is done */
+
+    struct DIRCACHE  *hnext;          /* hash chain */
+    struct DIRCACHE  *wnext;          /* same watch bucket */
+    struct DIRCACHE  *prev;           /* LRU list */
     struct DIRCACHE  *next;
 };
 
@@ -59,24 +90,24 @@ struct REQUEST {
     int		tcp_cork;
 
     struct sockaddr_storage peer;         /* client (log) */
+    socklen_t   peer_length;              /* 0: unknown yet */
     char        peerhost[MAX_HOST+1];
     char        peerserv[MAX_MISC+1];
     
     /* request */
-    char	hreq[MAX_HEADER+1];   /* request header */
     int 	lreq;		      /* request length */
     int         hdata;                /* data in hreq */
+    int         hscan;                /* hreq checked for end of header */
     char        type[MAX_MISC+1];     /* req type */
     char        hostname[MAX_HOST+1]; /* hostname */
-    char	uri[MAX_PATH+1];      /* req uri */
-    char	path[MAX_PATH+1];     /* file path */
-    char	query[MAX_PATH+1];    /* query string */
     int         major,minor;          /* http version */
     char        auth[64];
     struct strlist *header;
     char        *if_modified;
     char        *if_unmodified;
     char        *if_range;
+    char        *if_match;
+    char        *if_none_match;
     char        *range_hdr;
     int         ranges;
     off_t       *r_start;
@@ -84,11 +115,12 @@ struct REQUEST {
     char        *r_head;
     int         *r_hlen;
     char        *cors;
+    int         accept_enc;           /* ENC_* */
+    int         ls_format;            /* LS_*, for directories */
     
     /* response */
     int         status;              /* status code (log) */
     int         bc;                  /* byte counter (log) */
-    char	hres[MAX_HEADER+1];  /* response header */
     int	        lres;		     /* header length */
     char        *mime;               /* mime type */
     char	*body;
@@ -96,24 +128,66 @@ struct REQUEST {
     int         bfd;                 /* file descriptor */
     struct stat bst;                 /* file info */
     char        mtime[40];           /* RFC 1123 */
+    char        etag[ETAG_LEN];
+    char        *encoding;           /* precompressed file sent */
+    int         vary;                /* Accept-Encoding was looked at */
     off_t       written;
     int         head_only;
     int         rh,rb;
     struct DIRCACHE *dir;
+    struct FCACHE *fc;               /* bfd borrowed from the file cache */
+    struct LISTING *ls;              /* listing rendered while sent */
 
     /* CGI */
     int         cgipid;
     int         cgipipe;
-    char        cgibuf[MAX_HEADER+1];
     int         cgilen,cgipos;
 
 #ifdef USE_SSL
     /* SSL */
     SSL		*ssl_s;
+    int         ssl_want;            /* handshake: EV_*, 0 done, -1 failed */
+    struct EVLOOP *ssl_loop;         /* handshake threads hand it back */
+    struct REQUEST *ssl_next;
 #endif
 
+    /* event loop */
+    struct EVLOOP *loop;             /* the one we belong to */
+    struct REQUEST *ls_next;         /* parked for a directory scan */
+    int         ev_sock;             /* events registered for fd */
+    int         ev_pipe;             /* events registered for cgipipe */
+    int         ev_index;            /* position in ready list */
+    int         ev_done;             /* uring did the read/write ... */
+    int         ev_res;              /* ... with this result, see ev_result() */
+    struct msghdr ev_msg;            /* uring sendmsg */
+    struct iovec  ev_iov[2];
+
+    /* timer wheel */
+    time_t      expires;             /* timeout hits at this second */
+    struct REQUEST **t_slot;         /* wheel slot, NULL if unarmed */
+    struct REQUEST *t_prev;
+    struct REQUEST *t_next;
+
     /* linked list */
+    struct REQUEST *prev;
     struct REQUEST *next;
+
+    /* buffers -- only attached while a request is in flight */
+    struct REQBUF *buf;
+    char	*hreq;                /* request header */
+    char	*uri;                 /* req uri */
+    char	*path;                /* file path */
+    char	*query;               /* query string */
+    char	*hres;                /* response header */
+    char        *cgibuf;              /* CGI only */
+};
+
+struct REQBUF {
+    char	hreq[MAX_HEADER+1];
+    char	hres[MAX_HEADER+1];
+    char	uri[MAX_PATH+1];
+    char	path[MAX_PATH+1];
+    char	query[MAX_PATH+1];
 };
 
 /* --- string lists --------------------------------------------- */
@@ -156,6 +230,8 @@ list_free(struct strlist **list)
 extern int    debug;
 extern int    tcp_port;
 extern int    max_dircache;
+extern off_t  dircache_max;
+extern int    max_conn;
 extern int    virtualhosts;
 extern int    canonicalhost;
 extern int    do_chroot;
@@ -168,8 +244,15 @@ extern char   *userpass;
 extern char   *userdir;
 extern int    lifespan;
 extern int    no_listing;
-extern time_t now;
+extern THREAD_LOCAL time_t now;   /* per event loop */
 extern int     have_tty;
+extern char   *engine;
+extern char   *logfile;
+extern int    flushlog;
+extern int    fcache_max;
+extern int    fcache_valid;
+extern off_t  mcache_max;
+extern off_t  zcache_max;
 
 #ifdef USE_SSL
 extern int      with_ssl;
@@ -177,10 +260,12 @@ extern SSL_CTX  *ctx;
 extern BIO	*sbio, *ssl_bio;
 extern char     *certificate;
 extern char     *password;
+extern int      ssl_threads;
 #endif
 
 void xperror(int loglevel, char *txt, char *peerhost);
 void xerror(int loglevel, char *txt, char *peerhost);
+char *req_peerhost(struct REQUEST *req);
 
 static void inline close_on_exec(int fd)
 {
@@ -196,12 +281,176 @@ extern int ssl_write(struct REQUEST *req, char *buf, int len);
 extern int ssl_blk_write(struct REQUEST *req, off_t offset, size_t len);
 extern void init_ssl(void);
 extern void open_ssl_session(struct REQUEST *req);
+extern void close_ssl_session(struct REQUEST *req);
+extern void ssl_stats(void);
+extern int ssl_handshake(struct REQUEST *req);
+extern void ssl_start(void);
+extern int ssl_offload(struct EVLOOP *loop, struct REQUEST *req);
+extern struct REQUEST* ssl_offload_done(struct EVLOOP *loop);
 #endif
 
+/* --- date.c --------------------------------------------------- */
+
+#define DATE_LEN      29             /* Sun, 06 Nov 1994 08:49:37 GMT */
+#define CLF_LEN       28             /* [06/Nov/1994:08:49:37 +0000] */
+
+int   http_date(char *buf, time_t t);
+char* http_now(void);
+char* clf_now(void);
+time_t parse_date(char *p);
+
+/* --- fcache.c ------------------------------------------------ */
+
+#define FCACHE_SMALL  65536          /* max. file size kept in memory */
+#define FCACHE_ZVARIANTS 2           /* zstd, gzip */
+
+#define ZSTATE_NONE     0
+#define ZSTATE_PENDING  1            /* queued for compression */
+#define ZSTATE_DONE     2
+#define ZSTATE_FAILED   3            /* or not smaller, don't retry */
+
+struct FCACHE {
+    char             *path;
+    unsigned int     hash;
+    int              fd;             /* -1: in memory or open failed */
+    int              err;
+    struct stat      st;
+    char             *mime;
+    char             mtime[40];      /* RFC 1123 */
+    char             *data;          /* file contents (small files) */
+    char             head[384];      /* Content-*, ETag, ... header lines */
+    int              lhead;          /* 0: no preformatted header */
+    char             *zdata[FCACHE_ZVARIANTS];   /* compressed on the fly */
+    size_t           zlen[FCACHE_ZVARIANTS];
+    int              zstate[FCACHE_ZVARIANTS];
+    time_t           checked;        /* last stat() */
+    int              refcount;
+    int              cached;         /* still in the table */
+
+    struct FCACHE    *hnext;         /* hash chain */
+    struct FCACHE    *prev,*next;    /* lru list */
+};
+
+void  init_fcache(void);
+void  fcache_start(void);
+void  fcache_encode(struct REQUEST *req);
+struct FCACHE* fcache_get(char *path);
+void  fcache_release(struct FCACHE *f);
+void  fcache_close(struct REQUEST *req);
+void  fcache_stats(void);
+
+/* --- log.c ---------------------------------------------------- */
+
+void  log_open(void);
+void  log_start(void);
+void  log_stop(void);
+void  log_reopen(void);
+void  log_flush(void);
+void  log_stats(char *who);
+void  access_log(struct REQUEST *req);
+
+/* --- pool.c --------------------------------------------------- */
+
+#define POOL_ALIGN    16
+#define POOL_SLAB     16             /* objects per malloc */
+
+struct SLAB;
+
+struct POOL {
+    char             *name;
+    size_t           size;           /* object size */
+    size_t           clear;          /* bytes zeroed by pool_get */
+    void             *free;          /* free list */
+    struct SLAB      *slabs;
+    int              nslabs;
+    int              nfree;
+    int              inuse,peak;
+    unsigned long    gets,hits;
+};
+
+void  pool_init(struct POOL *p, char *name, size_t size, size_t clear);
+void* pool_get(struct POOL *p);
+void  pool_put(struct POOL *p, void *obj);
+void  pool_stats(struct POOL *p, char *who);
+
+/* --- timer.c -------------------------------------------------- */
+
+#define WHEEL_BITS    8
+#define WHEEL_SIZE    (1 << WHEEL_BITS)  /* one second slots */
+#define WHEEL1_SIZE   64                 /* WHEEL_SIZE seconds each */
+
+struct TIMERS {
+    time_t           tick;           /* next second to process */
+    int              count;
+    struct REQUEST   *wheel[WHEEL_SIZE];
+    struct REQUEST   *wheel1[WHEEL1_SIZE];
+};
+
+void  timer_init(struct TIMERS *t, time_t now);
+void  timer_set(struct TIMERS *t, struct REQUEST *req, time_t expires);
+void  timer_del(struct TIMERS *t, struct REQUEST *req);
+struct REQUEST* timer_expire(struct TIMERS *t, time_t now);
+int   timer_wait(struct TIMERS *t);
+
+/* --- event.c -------------------------------------------------- */
+
+#define EV_READ       1
+#define EV_WRITE      2
+#define EV_RELEASE    8              /* closed request may be freed now */
+
+#define ENGINE_SELECT 0
+#define ENGINE_EPOLL  1
+#define ENGINE_URING  2
+
+struct EVENT {
+    struct REQUEST   *req;           /* NULL: listening socket */
+    int              fd;             /* accepted connection (or -1) */
+    int              flags;
+};
+
+struct URING;
+
+struct EVLOOP {
+    int              engine;
+    int              efd;            /* epoll handle */
+    struct URING     *uring;
+    int              slisten;
+    int              listening;
+    int              room;           /* connections we may accept */
+
+    struct REQUEST   *conns;
+    int              nconns;
+
+    struct EVENT     *ready;
+    int              max_ready;
+
+    int              wakefd[2];      /* pipe, see ev_wake() */
+    struct REQUEST   *tls_done;      /* handshake steps done (lock-free) */
+    struct REQUEST   *ls_done;       /* directories scanned (lock-free) */
+
+    struct TIMERS    timers;
+    struct POOL      reqs;
+    struct POOL      bufs;           /* struct REQBUF */
+    struct POOL      cgibufs;
+};
+
+int   ev_init(struct EVLOOP *loop, int slisten);
+void  ev_free(struct EVLOOP *loop);
+char* ev_engine_name(struct EVLOOP *loop);
+void  ev_listen(struct EVLOOP *loop, int room);
+int   ev_update(struct EVLOOP *loop, struct REQUEST *req);
+int   ev_sends(struct EVLOOP *loop, struct REQUEST *req);
+int   ev_result(struct REQUEST *req);
+int   ev_forget(struct EVLOOP *loop, struct REQUEST *req);
+int   ev_wait(struct EVLOOP *loop, int timeout);
+int   ev_wakeup(struct EVLOOP *loop);
+void  ev_wake(struct EVLOOP *loop);
+
 /* --- request.c ------------------------------------------------ */
 
 void read_request(struct REQUEST *req, int pipelined);
 void parse_request(struct REQUEST *req);
+void dir_request(struct REQUEST *req);
 
 /* --- response.c ----------------------------------------------- */
 
@@ -216,14 +465,36 @@ void mkerror(struct REQUEST *req, int status, int ka);
 void mkredirect(struct REQUEST *req);
 void mkheader(struct REQUEST *req, int status);
 void mkcgi(struct REQUEST *req, char *status, struct strlist *header);
+int  mketag(char *buf, struct stat *st, char *encoding, int weak);
 void write_request(struct REQUEST *req);
 
 /* --- ls.c ----------------------------------------------------- */
 
+struct LSOUT {
+    char        *buf;
+    int         len,size;
+};
+
+struct LISTING {
+    struct LSOUT out;                /* chunk being sent */
+    int         written;
+    int         pos,end;             /* entries left to render */
+    int         offset,limit;        /* page, limit 0: all */
+    int         step;
+    int         lines;               /* entries rendered */
+    int         format;              /* LS_* */
+    int         chunked;             /* Transfer-Encoding: chunked */
+};
+
 void init_quote(void);
 char*  quote(unsigned char *path, int maxlength);
 struct DIRCACHE *get_dir(struct REQUEST *req, char *filename);
+void  ls_body(struct REQUEST *req);
+struct REQUEST* ls_scan_done(struct EVLOOP *loop);
 void free_dir(struct DIRCACHE *dir);
+int   ls_start(struct REQUEST *req, int offset, int limit);
+int   ls_fill(struct REQUEST *req);
+void  ls_free(struct REQUEST *req);
 
 /* --- mime.c --------------------------------------------------- */
 
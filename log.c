@@ -0,0 +1,384 @@
+/*
+ * access log -- request threads drop fixed-size records into a
+ * per-thread ring (single producer, single consumer, no locks), a
+ * writer thread formats them and writes them out in batches.  Without
+ * threads the event loop drains its ring once per iteration.  With -L
+ * (flushlog) the first record in an empty ring wakes the writer, lines
+ * are written out as soon as the request is done.  Otherwise a ring
+ * half full wakes it.  Nothing is dropped: a request thread finding
+ * its ring full writes the log itself.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "httpd.h"
+
+#define LOG_RING      1024           /* records per thread, power of two */
+#define LOG_URI       336            /* longer ones go to long_uri */
+#define LOG_BUF       65536          /* write batch size */
+#define LOG_IDLE_MS   100            /* writer sleep, nothing to do */
+#define LOG_BUSY_MS   10             /* writer sleep, after writing */
+#define LOG_WAKE_MS   1000           /* -L writer wait, reopen / stop */
+
+struct LOGREC {
+    time_t                  t;
+    int                     status;
+    int                     bc;
+    short                   major,minor;
+    socklen_t               peer_length;
+    struct sockaddr_storage peer;
+    char                    type[MAX_MISC+1];
+    char                    uri[LOG_URI];
+    char                    *long_uri; /* malloc()ed, freed by writer */
+};
+
+struct LOGRING {
+    unsigned int            head;    /* written by request thread */
+    char                    pad1[60];
+    unsigned int            tail;    /* written by log writer */
+    char                    pad2[60];
+    unsigned long           lines;
+    unsigned long           full;    /* written by request thread */
+    struct LOGRING          *next;
+    struct LOGREC           rec[LOG_RING];
+};
+
+static int                          logfd = -1;
+static struct LOGRING               *rings;
+static THREAD_LOCAL struct LOGRING  *ring;
+static char                         logbuf[LOG_BUF];
+static volatile int                 reopen;
+
+#ifdef USE_THREADS
+static pthread_mutex_t              lock_rings = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t                    writer;
+static volatile int                 stop;
+static int                          running;
+
+/* access_log() kicks the writer */
+static pthread_mutex_t              lock_kick = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t               kick_cond = PTHREAD_COND_INITIALIZER;
+static int                          kicked;
+#endif
+
+/* ---------------------------------------------------------------------- */
+
+static int
+log_open_file(void)
+{
+    int fd;
+
+    if (0 == strcmp(logfile,"-"))
+	return 1;
+    if (-1 == (fd = open(logfile, O_WRONLY | O_CREAT | O_APPEND, 0666))) {
+	xperror(LOG_WARNING,"open access log",NULL);
+	return -1;
+    }
+    close_on_exec(fd);
+    return fd;
+}
+
+static void
+log_write(char *buf, int len)
+{
+    int rc;
+
+    while (len > 0) {
+	rc = write(logfd,buf,len);
+	if (-1 == rc && EINTR == errno)
+	    continue;
+	if (rc <= 0)
+	    /* nothing we can do about it */
+	    return;
+	buf += rc;
+	len -= rc;
+    }
+}
+
+static int
+log_format(char *buf, struct LOGREC *rec)
+{
+    char host[MAX_HOST+1];
+    int len;
+
+    if (0 == rec->peer_length ||
+	0 != getnameinfo((struct sockaddr*)&rec->peer,rec->peer_length,
+			 host,sizeof(host),NULL,0,NI_NUMERICHOST))
+	strcpy(host,"?");
+
+    /* clf_now() caches per second and thread, we are a thread too */
+    now = rec->t;
+    if (400 == rec->status)
+	return sprintf(buf,"%s - - %s \"-\" 400 %d\n",
+		       host,clf_now(),rec->bc);
+    len = sprintf(buf,"%s - - %s \"%s %s HTTP/%d.%d\" %d %d\n",
+		  host,clf_now(),rec->type,
+		  rec->long_uri ? rec->long_uri : rec->uri,
+		  rec->major,rec->minor,rec->status,rec->bc);
+    free(rec->long_uri);
+    rec->long_uri = NULL;
+    return len;
+}
+
+/* drain one ring, returns the number of records */
+static int
+log_drain(struct LOGRING *r)
+{
+    unsigned int head,tail;
+    int len = 0;
+
+    head = __atomic_load_n(&r->head,__ATOMIC_ACQUIRE);
+    for (tail = r->tail; tail != head; tail++) {
+	if (len > LOG_BUF - 512 - MAX_PATH) {
+	    log_write(logbuf,len);
+	    len = 0;
+	}
+	len += log_format(logbuf+len, &r->rec[tail & (LOG_RING-1)]);
+    }
+    if (len)
+	log_write(logbuf,len);
+    head -= r->tail;
+    __atomic_store_n(&r->tail,tail,__ATOMIC_RELEASE);
+    return head;
+}
+
+static int
+log_drain_all(void)
+{
+    struct LOGRING *r;
+    time_t saved = now;
+    int n = 0;
+
+    DO_LOCK(lock_rings);
+    if (reopen) {
+	reopen = 0;
+	if (debug)
+	    fprintf(stderr,"got SIGHUP, reopen logfile %s\n",logfile);
+	if (logfd > 2)
+	    close(logfd);
+	logfd = log_open_file();
+    }
+    if (-1 != logfd)
+	for (r = rings; r; r = r->next)
+	    n += log_drain(r);
+    DO_UNLOCK(lock_rings);
+    now = saved;
+    return n;
+}
+
+#ifdef USE_THREADS
+static void
+log_kick(void)
+{
+    DO_LOCK(lock_kick);
+    kicked = 1;
+    pthread_cond_signal(&kick_cond);
+    DO_UNLOCK(lock_kick);
+}
+
+/* -L: records came in after log_drain() had looked at the ring? */
+static int
+log_pending(void)
+{
+    struct LOGRING *r;
+
+    /* pairs with the fence in access_log(): either we see the new
+       head or the producer sees our tail and kicks */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (r = __atomic_load_n(&rings,__ATOMIC_ACQUIRE); r; r = r->next)
+	if (__atomic_load_n(&r->head,__ATOMIC_ACQUIRE) != r->tail)
+	    return 1;
+    return 0;
+}
+
+/* sleep for ms, or until kicked */
+static void
+log_wait(int ms)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME,&ts);
+    ts.tv_sec  += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+	ts.tv_sec++;
+	ts.tv_nsec -= 1000000000;
+    }
+    DO_LOCK(lock_kick);
+    while (!kicked && !stop && !(flushlog && log_pending()))
+	if (ETIMEDOUT == pthread_cond_timedwait(&kick_cond,&lock_kick,&ts))
+	    break;
+    kicked = 0;
+    DO_UNLOCK(lock_kick);
+}
+
+static void*
+log_writer(void *arg)
+{
+    int n;
+
+    while (!stop) {
+	n = log_drain_all();
+	log_wait(flushlog ? LOG_WAKE_MS : n ? LOG_BUSY_MS : LOG_IDLE_MS);
+    }
+    return NULL;
+}
+#endif
+
+/* ---------------------------------------------------------------------- */
+
+void
+log_open(void)
+{
+    logfd = log_open_file();
+}
+
+/* start the writer, call this after fork() */
+void
+log_start(void)
+{
+#ifdef USE_THREADS
+    if (-1 == logfd)
+	return;
+    if (0 != pthread_create(&writer,NULL,log_writer,NULL)) {
+	xperror(LOG_WARNING,"start log writer",NULL);
+	return;
+    }
+    running = 1;
+#endif
+}
+
+/* flush everything, call on exit */
+void
+log_stop(void)
+{
+#ifdef USE_THREADS
+    if (running) {
+	stop = 1;
+	log_kick();
+	pthread_join(writer,NULL);
+	running = 0;
+    }
+#endif
+    log_drain_all();
+    if (logfd > 2)
+	close(logfd);
+    logfd = -1;
+}
+
+void
+log_reopen(void)
+{
+    if (NULL == logfile || 0 == strcmp(logfile,"-"))
+	return;
+    reopen = 1;
+#ifndef USE_THREADS
+    log_drain_all();
+#endif
+}
+
+/* no writer thread: the event loop writes the records itself */
+void
+log_flush(void)
+{
+#ifdef USE_THREADS
+    if (running)
+	return;
+#endif
+    if (ring && ring->head != ring->tail)
+	log_drain_all();
+}
+
+void
+log_stats(char *who)
+{
+    char msg[128];
+
+    if (NULL == ring)
+	return;
+    snprintf(msg,sizeof(msg),"%s access log: %lu lines, ring full %lu times",
+	     who,ring->lines,ring->full);
+    xerror(LOG_NOTICE,msg,NULL);
+}
+
+void
+access_log(struct REQUEST *req)
+{
+    struct LOGREC *rec;
+    unsigned int head,used;
+    size_t len;
+
+    if (-1 == logfd)
+	return;
+    if (NULL == ring) {
+	/* first request logged by this thread */
+	if (NULL == (ring = malloc(sizeof(*ring))))
+	    return;
+	memset(ring,0,offsetof(struct LOGRING,rec));
+	DO_LOCK(lock_rings);
+	ring->next = rings;
+	__atomic_store_n(&rings,ring,__ATOMIC_RELEASE);
+	DO_UNLOCK(lock_rings);
+    }
+
+    head = ring->head;
+    used = head - __atomic_load_n(&ring->tail,__ATOMIC_ACQUIRE);
+    if (used >= LOG_RING) {
+	/* the writer can't keep up, do it ourself (waits for the
+	   writer to finish its batch), the log is not lossy */
+	ring->full++;
+	log_drain_all();
+	used = 0;
+    }
+    rec = &ring->rec[head & (LOG_RING-1)];
+    rec->long_uri = NULL;
+
+    /* common log format: host ident authuser date request status bytes */
+    if (0 == req->status)
+	req->status = 400; /* bad request */
+    rec->t      = now;
+    rec->status = req->status;
+    rec->bc     = req->bc;
+    if (0 == req->peer_length)
+	req_peerhost(req);
+    rec->peer_length = req->peer_length;
+    memcpy(&rec->peer,&req->peer,req->peer_length);
+    if (400 != req->status) {
+	rec->major = req->major;
+	rec->minor = req->minor;
+	memcpy(rec->type,req->type,sizeof(rec->type));
+	len = strlen(req->uri);
+	if (len < LOG_URI) {
+	    memcpy(rec->uri,req->uri,len+1);
+	} else if (NULL == (rec->long_uri = strdup(req->uri))) {
+	    /* out of memory, log what fits and mark it */
+	    memcpy(rec->uri,req->uri,LOG_URI-4);
+	    strcpy(rec->uri+LOG_URI-4,"...");
+	}
+    }
+    ring->lines++;
+    __atomic_store_n(&ring->head,head+1,__ATOMIC_RELEASE);
+#ifdef USE_THREADS
+    if (!running)
+	return;
+    if (flushlog) {
+	/* kick only if the ring was empty, the writer is busy with
+	   it otherwise and finds our record in log_pending() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (head == __atomic_load_n(&ring->tail,__ATOMIC_ACQUIRE))
+	    log_kick();
+    } else if (used + 1 == LOG_RING/2) {
+	log_kick();
+    }
+#endif
+}
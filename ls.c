@@ -3,11 +3,14 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
 #include <dirent.h>
 #include <ctype.h>
 #include <pwd.h>
 #include <grp.h>
 #include <time.h>
+#include <stddef.h>
 #include <inttypes.h>
 #include <sys/time.h>
 #include <sys/stat.h>
@@ -17,13 +20,14 @@
 
 #include "httpd.h"
 
+#if defined(__linux__) && !defined(NO_INOTIFY)
+# include <sys/inotify.h>
+# define HAVE_INOTIFY 1
+#endif
+
 #define LS_ALLOC_SIZE (4 * 4096)
 #define HOMEPAGE "https://httpit.rodmena.co.uk"
 
-#ifdef USE_THREADS
-static pthread_mutex_t lock_dircache = PTHREAD_MUTEX_INITIALIZER;
-#endif
-
 /* --------------------------------------------------------- */
 
 #define CACHE_SIZE 32
@@ -31,9 +35,11 @@ static pthread_mutex_t lock_dircache = PTHREAD_MUTEX_INITIALIZER;
 static char*
 xgetpwuid(uid_t uid)
 {
-    static char           *cache[CACHE_SIZE];
-    static uid_t          uids[CACHE_SIZE];
-    static unsigned int   used,next;
+    /* per thread, listings are rendered by all event loops */
+    static THREAD_LOCAL char          *cache[CACHE_SIZE];
+    static THREAD_LOCAL uid_t         uids[CACHE_SIZE];
+    static THREAD_LOCAL unsigned int  used,next;
+    char *name;
 
     struct passwd *pw;
     int i;
@@ -59,19 +65,22 @@ xgetpwuid(uid_t uid)
 	fprintf(stderr,"uid: %3d  n=%2d, name=%s\n",
 		(int)uid, next, cache[next] ? cache[next] : "?");
 
+    name = cache[next];
     next++;
     if (CACHE_SIZE == next) next = 0;
     if (used < CACHE_SIZE) used++;
 
-    return pw ? pw->pw_name : NULL;
+    return name;
 }
 
 static char*
 xgetgrgid(gid_t gid)
 {
-    static char           *cache[CACHE_SIZE];
-    static gid_t          gids[CACHE_SIZE];
-    static unsigned int   used,next;
+    /* per thread, listings are rendered by all event loops */
+    static THREAD_LOCAL char          *cache[CACHE_SIZE];
+    static THREAD_LOCAL gid_t         gids[CACHE_SIZE];
+    static THREAD_LOCAL unsigned int  used,next;
+    char *name;
 
     struct group *gr;
     int i;
@@ -97,29 +106,154 @@ xgetgrgid(gid_t gid)
 	fprintf(stderr,"gid: %3d  n=%2d, name=%s\n",
 		(int)gid,next,cache[next] ? cache[next] : "?");
 
+    name = cache[next];
     next++;
     if (CACHE_SIZE == next) next = 0;
     if (used < CACHE_SIZE) used++;
 
-    return gr ? gr->gr_name : NULL;
+    return name;
 }
 
 /* --------------------------------------------------------- */
 
+/* directory entries are packed into one arena, only the fields the
+   listing shows are kept */
 struct myfile {
+    off_t         size;
+    time_t        mtime;
+    ino_t         ino;              /* for the json etag */
+    mode_t        mode;
+    uid_t         uid;
+    gid_t         gid;
     int           r;
-    struct stat   s;
     char          n[1];
 };
 
+struct myarena {
+    char          *mem;
+    size_t        used,size;
+};
+
+#define ARENA_CHUNK   (64 * 1024)
+#define ARENA_ALIGN   (__alignof__(struct myfile))
+#define MYFILE_SIZE(name) ((offsetof(struct myfile,n) + strlen(name) + 1 + \
+			    ARENA_ALIGN-1) & ~(ARENA_ALIGN-1))
+
+static struct myfile*
+arena_add(struct myarena *a, char *name)
+{
+    size_t need = MYFILE_SIZE(name);
+    struct myfile *f;
+    char *mem;
+
+    if (a->used + need > a->size) {
+	mem = realloc(a->mem, a->size + need + ARENA_CHUNK);
+	if (NULL == mem)
+	    return NULL;
+	a->mem   = mem;
+	a->size += need + ARENA_CHUNK;
+    }
+    f = (struct myfile*)(a->mem + a->used);
+    strcpy(f->n,name);
+    return f;
+}
+
+/* stat relative to the open directory, no path lookup per entry */
+static int
+stat_entry(int dfd, struct myfile *f)
+{
+    struct stat st;
+#if defined(__linux__) && defined(STATX_BASIC_STATS)
+    static int no_statx;
+    struct statx stx;
+
+    if (!no_statx) {
+	/* ask for what we show only, may skip work on network fs */
+	if (0 == statx(dfd, f->n, AT_NO_AUTOMOUNT | AT_STATX_DONT_SYNC,
+		       STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID |
+		       STATX_MTIME | STATX_SIZE | STATX_INO, &stx)) {
+	    f->mode  = stx.stx_mode;
+	    f->uid   = stx.stx_uid;
+	    f->gid   = stx.stx_gid;
+	    f->mtime = stx.stx_mtime.tv_sec;
+	    f->size  = stx.stx_size;
+	    f->ino   = stx.stx_ino;
+	    return 0;
+	}
+	if (ENOSYS != errno)
+	    return -1;
+	/* kernel older than 4.11 */
+	no_statx = 1;
+    }
+#endif
+    if (-1 == fstatat(dfd, f->n, &st, 0))
+	return -1;
+    f->mode  = st.st_mode;
+    f->uid   = st.st_uid;
+    f->gid   = st.st_gid;
+    f->mtime = st.st_mtime;
+    f->size  = st.st_size;
+    f->ino   = st.st_ino;
+    return 0;
+}
+
+/* read the directory into the arena, returns the number of entries */
+static int
+scan_dir(char *filename, char *path, struct myarena *a)
+{
+    DIR            *dir;
+    struct dirent  *file;
+    struct myfile  *f;
+    int            count = 0,uid,gid;
+
+    if (NULL == (dir = opendir(filename)))
+	return -1;
+    uid = getuid();
+    gid = getgid();
+    while (NULL != (file = readdir(dir))) {
+	if (0 == strcmp(file->d_name,"."))
+	    /* skip the the "." directory */
+	    continue;
+	if (0 == strcmp(path,"/") && 0 == strcmp(file->d_name,".."))
+	    /* skip the ".." directory in root dir */
+	    continue;
+	if (NULL == (f = arena_add(a,file->d_name))) {
+	    closedir(dir);
+	    return -1;
+	}
+	if (-1 == stat_entry(dirfd(dir),f))
+	    continue;
+
+	f->r = 0;
+	if (S_ISDIR(f->mode) || S_ISREG(f->mode)) {
+	    if (f->uid == uid && f->mode & 0400)
+		f->r = 1;
+	    else if (f->gid == gid && f->mode & 0040)
+		f->r = 1; /* FIXME: check additional groups */
+	    else if (f->mode & 0004)
+		f->r = 1;
+	}
+	/* keep it */
+	a->used += MYFILE_SIZE(f->n);
+	count++;
+    }
+    closedir(dir);
+    return count;
+}
+
 static int
 compare_files(const void *a, const void *b)
 {
     const struct myfile *aa = *(struct myfile**)a;
     const struct myfile *bb = *(struct myfile**)b;
 
-    if (S_ISDIR(aa->s.st_mode) !=  S_ISDIR(bb->s.st_mode))
-	return S_ISDIR(aa->s.st_mode) ? -1 : 1;
+    if (S_ISDIR(aa->mode) !=  S_ISDIR(bb->mode))
+	return S_ISDIR(aa->mode) ? -1 : 1;
+    /* ".." first, the json formats skip it */
+    if (0 == strcmp(aa->n,".."))
+	return -1;
+    if (0 == strcmp(bb->n,".."))
+	return 1;
     return strcmp(aa->n,bb->n);
 }
 
@@ -142,7 +276,7 @@ init_quote(void)
 char*
 quote(unsigned char *path, int maxlength)
 {
-    static unsigned char buf[2048]; /* FIXME: threads break this... */
+    static THREAD_LOCAL unsigned char buf[2048];
     int i,j,n=strlen((const char *)path);
 
     if (n > maxlength)
@@ -186,106 +320,59 @@ static void strmode(mode_t mode, char *dest)
 }
 #endif
 
-static char*
-ls(time_t now, char *hostname, char *filename, char *path, int *length)
-{
-    DIR            *dir;
-    struct dirent  *file;
-    struct myfile  **files = NULL;
-    struct myfile  **re1;
-    char           *h1,*h2,*re2,*buf = NULL;
-    int            count,len,size,i,uid,gid;
-    char           line[1024];
-    char           *pw = NULL, *gr = NULL;
-
-    if (debug)
-	fprintf(stderr,"dir: reading %s\n",filename);
-    if (NULL == (dir = opendir(filename)))
-	return NULL;
-
-    /* read dir */
-    uid = getuid();
-    gid = getgid();
-    for (count = 0;; count++) {
-	if (NULL == (file = readdir(dir)))
-	    break;
-	if (0 == strcmp(file->d_name,".")) {
-	    /* skip the the "." directory */
-	    count--;
-	    continue;
-	}
-	if (0 == strcmp(path,"/") && 0 == strcmp(file->d_name,"..")) {
-	    /* skip the ".." directory in root dir */
-	    count--;
-	    continue;
-	}
+/* --------------------------------------------------------- */
+/* output, html or json.  Small listings are rendered once per       */
+/* format and cached, big ones (and pages, ?offset=n&limit=m) are    */
+/* rendered from the sorted index while they are sent, in chunks of  */
+/* LS_CHUNK bytes.                                                   */
 
-	if (0 == (count % 64)) {
-	    re1 = realloc(files,(count+64)*sizeof(struct myfile*));
-	    if (NULL == re1)
-		goto oom;
-	    files = re1;
-	}
+#define LS_INLINE   1000           /* more entries: stream */
+#define LS_CHUNK    (32 * 1024)
+#define LS_LINE_MAX (4 * 1024)     /* one entry, worst case */
 
-	files[count] = malloc(strlen(file->d_name)+sizeof(struct myfile));
-	if (NULL == files[count])
-	    goto oom;
-	strcpy(files[count]->n,file->d_name);
-	sprintf(line,"%s/%s",filename,file->d_name);
-	if (-1 == stat(line,&files[count]->s)) {
-	    free(files[count]);
-	    count--;
-	    continue;
-	}
+#define LS_HEAD     0
+#define LS_ENTRIES  1
+#define LS_TAIL     2
+#define LS_DONE     3              /* chunked: last chunk pending */
+#define LS_END      4
 
-	files[count]->r = 0;
-	if (S_ISDIR(files[count]->s.st_mode) ||
-	    S_ISREG(files[count]->s.st_mode)) {
-	    if (files[count]->s.st_uid == uid &&
-		files[count]->s.st_mode & 0400)
-		files[count]->r = 1;
-	    else if (files[count]->s.st_uid == gid &&
-		     files[count]->s.st_mode & 0040)
-		files[count]->r = 1; /* FIXME: check additional groups */
-	    else if (files[count]->s.st_mode & 0004)
-		files[count]->r = 1;
-	}
-    }
-    closedir(dir);
-
-    /* sort */
-    if (count)
-	qsort(files,count,sizeof(struct myfile*),compare_files);
+static int
+out_room(struct LSOUT *o, int need)
+{
+    char *buf;
 
-    /* output */
-    size = LS_ALLOC_SIZE;
-    buf  = malloc(size);
+    if (o->len + need <= o->size)
+	return 0;
+    buf = realloc(o->buf, o->len + need + LS_ALLOC_SIZE);
     if (NULL == buf)
-	goto oom;
-    len  = 0;
+	return -1;
+    o->buf  = buf;
+    o->size = o->len + need + LS_ALLOC_SIZE;
+    return 0;
+}
+
+static int
+ls_head(struct LSOUT *o, struct DIRCACHE *dir, char *hostname, char *path)
+{
+    char *h1,*h2;
 
-    len += sprintf(buf+len,
-		   "<head><title>%s:%d%s</title></head>\n"
-		   "<body bgcolor=white text=black link=darkblue vlink=firebrick alink=red>\n"
-		   "<h1>listing: \n",
-		   hostname,tcp_port,path);
+    if (-1 == out_room(o, LS_LINE_MAX))
+	return -1;
+    o->len += sprintf(o->buf+o->len,
+		      "<head><title>%s:%d%s</title></head>\n"
+		      "<body bgcolor=white text=black link=darkblue vlink=firebrick alink=red>\n"
+		      "<h1>listing: \n",
+		      hostname,tcp_port,path);
 
     h1 = path, h2 = path+1;
     for (;;) {
-	if (len > size)
-	    abort();
-	if (len+(LS_ALLOC_SIZE>>2) > size) {
-	    size += LS_ALLOC_SIZE;
-	    re2 = realloc(buf,size);
-	    if (NULL == re2)
-		goto oom;
-	    buf = re2;
-	}
-	len += sprintf(buf+len,"<a href=\"%s\">%*.*s</a>",
-		       quote((unsigned char *)path,h2-path),
-		       (int)(h2-h1),
-		       (int)(h2-h1),
-		       h1);
+	if (-1 == out_room(o, LS_LINE_MAX))
+	    return -1;
+	o->len += sprintf(o->buf+o->len,"<a href=\"%s\">%*.*s</a>",
+			  quote((unsigned char *)path,h2-path),
+			  (int)(h2-h1),
+			  (int)(h2-h1),
+			  h1);
 	h1 = h2;
 	h2 = strchr(h2,'/');
 	if (NULL == h2)
@@ -293,118 +380,714 @@ ls(time_t now, char *hostname, char *filename, char *path, int *length)
 	h2++;
     }
 
-    len += sprintf(buf+len,
-		   "</h1><hr noshade size=1><pre>\n"
-		   "<b>access      user      group     date             "
-		   "size  name</b>\n\n");
-
-    for (i = 0; i < count; i++) {
-	if (len > size)
-	    abort();
-	if (len+(LS_ALLOC_SIZE>>2) > size) {
-	    size += LS_ALLOC_SIZE;
-	    re2 = realloc(buf,size);
-	    if (NULL == re2)
-		goto oom;
-	    buf = re2;
-	}
+    o->len += sprintf(o->buf+o->len,
+		      "</h1><hr noshade size=1><pre>\n"
+		      "<b>access      user      group     date             "
+		      "size  name</b>\n\n");
+    return 0;
+}
+
+static int
+ls_line(struct LSOUT *o, struct myfile *f, time_t now, int n)
+{
+    char *buf, *pw, *gr;
+    int len;
+
+    if (-1 == out_room(o, LS_LINE_MAX))
+	return -1;
+    buf = o->buf;
+    len = o->len;
+
+    /* mode */
+    strmode(f->mode, buf+len);
+    len += 10;
+    buf[len++] = ' ';
+    buf[len++] = ' ';
+
+    /* user */
+    pw = xgetpwuid(f->uid);
+    if (NULL != pw)
+	len += sprintf(buf+len,"%-8.8s  ",pw);
+    else
+	len += sprintf(buf+len,"%8d  ",(int)f->uid);
+
+    /* group */
+    gr = xgetgrgid(f->gid);
+    if (NULL != gr)
+	len += sprintf(buf+len,"%-8.8s  ",gr);
+    else
+	len += sprintf(buf+len,"%8d  ",(int)f->gid);
+
+    /* mtime */
+    if (now - f->mtime > 60*60*24*30*6)
+	len += strftime(buf+len,255,"%b %d  %Y  ",
+			gmtime(&f->mtime));
+    else
+	len += strftime(buf+len,255,"%b %d %H:%M  ",
+			gmtime(&f->mtime));
+
+    /* size */
+    if (S_ISDIR(f->mode)) {
+	len += sprintf(buf+len,"  &lt;DIR&gt;  ");
+    } else if (!S_ISREG(f->mode)) {
+	len += sprintf(buf+len,"     --  ");
+    } else if (f->size < 1024*9) {
+	len += sprintf(buf+len,"%4d  B  ",
+		       (int)f->size);
+    } else if (f->size < 1024*1024*9) {
+	len += sprintf(buf+len,"%4d kB  ",
+		       (int)(f->size>>10));
+    } else if ((int64_t)(f->size) < (int64_t)1024*1024*1024*9) {
+	len += sprintf(buf+len,"%4d MB  ",
+		       (int)(f->size>>20));
+    } else if ((int64_t)(f->size) < (int64_t)1024*1024*1024*1024*9) {
+	len += sprintf(buf+len,"%4d GB  ",
+		       (int)(f->size>>30));
+    } else {
+	len += sprintf(buf+len,"%4d TB  ",
+		       (int)(f->size>>40));
+    }
 
-	/* mode */
-	strmode(files[i]->s.st_mode, buf+len);
-	len += 10;
-	buf[len++] = ' ';
-	buf[len++] = ' ';
-
-	/* user */
-	pw = xgetpwuid(files[i]->s.st_uid);
-	if (NULL != pw)
-	    len += sprintf(buf+len,"%-8.8s  ",pw);
-	else
-	    len += sprintf(buf+len,"%8d  ",(int)files[i]->s.st_uid);
-
-	/* group */
-	gr = xgetgrgid(files[i]->s.st_gid);
-	if (NULL != gr)
-	    len += sprintf(buf+len,"%-8.8s  ",gr);
-	else
-	    len += sprintf(buf+len,"%8d  ",(int)files[i]->s.st_gid);
-
-	/* mtime */
-	if (now - files[i]->s.st_mtime > 60*60*24*30*6)
-	    len += strftime(buf+len,255,"%b %d  %Y  ",
-			    gmtime(&files[i]->s.st_mtime));
-	else
-	    len += strftime(buf+len,255,"%b %d %H:%M  ",
-			    gmtime(&files[i]->s.st_mtime));
-
-	/* size */
-	if (S_ISDIR(files[i]->s.st_mode)) {
-	    len += sprintf(buf+len,"  &lt;DIR&gt;  ");
-	} else if (!S_ISREG(files[i]->s.st_mode)) {
-	    len += sprintf(buf+len,"     --  ");
-	} else if (files[i]->s.st_size < 1024*9) {
-	    len += sprintf(buf+len,"%4d  B  ",
-			   (int)files[i]->s.st_size);
-	} else if (files[i]->s.st_size < 1024*1024*9) {
-	    len += sprintf(buf+len,"%4d kB  ",
-			   (int)(files[i]->s.st_size>>10));
-	} else if ((int64_t)(files[i]->s.st_size) < (int64_t)1024*1024*1024*9) {
-	    len += sprintf(buf+len,"%4d MB  ",
-			   (int)(files[i]->s.st_size>>20));
-	} else if ((int64_t)(files[i]->s.st_size) < (int64_t)1024*1024*1024*1024*9) {
-	    len += sprintf(buf+len,"%4d GB  ",
-			   (int)(files[i]->s.st_size>>30));
+    /* filename */
+    if (f->r) {
+	len += sprintf(buf+len,"<a href=\"%s%s\">%s</a>\n",
+		       quote((unsigned char *)f->n,9999),
+		       S_ISDIR(f->mode) ? "/" : "",
+		       f->n);
+    } else {
+	len += sprintf(buf+len,"%s\n",f->n);
+    }
+    o->len = len;
+    return 1;
+}
+
+/* page navigation if limit is set */
+static int
+ls_tail(struct LSOUT *o, struct DIRCACHE *dir, time_t now,
+	int offset, int limit)
+{
+    int count = dir->count;
+    char line[32];
+
+    if (-1 == out_room(o, LS_LINE_MAX))
+	return -1;
+    o->len += sprintf(o->buf+o->len,"</pre><hr noshade size=1>\n");
+    if (limit) {
+	if (offset > 0)
+	    o->len += sprintf(o->buf+o->len,
+			      "<a href=\"?offset=%d&amp;limit=%d\">&lt;&lt;</a> ",
+			      offset > limit ? offset-limit : 0, limit);
+	o->len += sprintf(o->buf+o->len,"%d-%d of %d",
+			  offset < count ? offset+1 : count,
+			  limit < count-offset ? offset+limit : count,
+			  count);
+	if (limit < count-offset)
+	    o->len += sprintf(o->buf+o->len,
+			      " <a href=\"?offset=%d&amp;limit=%d\">&gt;&gt;</a>",
+			      offset+limit, limit);
+	o->len += sprintf(o->buf+o->len,"<hr noshade size=1>\n");
+    }
+    strftime(line,32,"%d/%b/%Y %H:%M:%S GMT",gmtime(&now));
+    o->len += sprintf(o->buf+o->len,
+		      "<small><a href=\"%s\">%s</a> &nbsp; %s</small>\n"
+		      "</body>\n",
+		      HOMEPAGE,server_name,line);
+    return 0;
+}
+
+/* json string, escaped; up to 6 bytes per byte of str + 2 */
+static int
+json_str(char *buf, char *str)
+{
+    unsigned char *s = (unsigned char*)str;
+    int len = 0;
+
+    buf[len++] = '"';
+    for (; *s; s++) {
+	if (*s == '"' || *s == '\\') {
+	    buf[len++] = '\\';
+	    buf[len++] = *s;
+	} else if (*s < 0x20) {
+	    len += sprintf(buf+len,"\\u%04x",*s);
 	} else {
-	    len += sprintf(buf+len,"%4d TB  ",
-			   (int)(files[i]->s.st_size>>40));
+	    buf[len++] = *s;
 	}
+    }
+    buf[len++] = '"';
+    buf[len] = 0;
+    return len;
+}
 
-	/* filename */
-	if (files[i]->r) {
-	    len += sprintf(buf+len,"<a href=\"%s%s\">%s</a>\n",
-			   quote((unsigned char *)files[i]->n,9999),
-			   S_ISDIR(files[i]->s.st_mode) ? "/" : "",
-			   files[i]->n);
-	} else {
-	    len += sprintf(buf+len,"%s\n",files[i]->n);
+/* one entry as json object, the etag is the one a GET would send */
+static int
+json_entry(struct LSOUT *o, struct myfile *f)
+{
+    struct stat st;
+    char etag[64], *type;
+
+    if (-1 == out_room(o, LS_LINE_MAX))
+	return -1;
+    memset(&st,0,sizeof(st));
+    st.st_ino   = f->ino;
+    st.st_size  = f->size;
+    st.st_mtime = f->mtime;
+    mketag(etag,&st,NULL,0);
+    if (S_ISDIR(f->mode))
+	type = "dir";
+    else if (S_ISREG(f->mode))
+	type = "file";
+    else
+	type = "other";
+
+    o->len += sprintf(o->buf+o->len,"{\"name\":");
+    o->len += json_str(o->buf+o->len,f->n);
+    o->len += sprintf(o->buf+o->len,
+		      ",\"type\":\"%s\",\"size\":%" PRId64
+		      ",\"mtime\":%" PRId64 ",\"etag\":",
+		      type,(int64_t)f->size,(int64_t)f->mtime);
+    o->len += json_str(o->buf+o->len,etag);
+    o->buf[o->len++] = '}';
+    return 0;
+}
+
+/* entries without "..", it sorts first */
+static int
+json_count(struct DIRCACHE *dir)
+{
+    if (dir->count && 0 == strcmp(dir->files[0]->n,".."))
+	return dir->count-1;
+    return dir->count;
+}
+
+static int
+json_head(struct LSOUT *o, struct DIRCACHE *dir, char *hostname, char *path)
+{
+    if (-1 == out_room(o, 6*strlen(path) + LS_LINE_MAX))
+	return -1;
+    o->len += sprintf(o->buf+o->len,"{\"path\":");
+    o->len += json_str(o->buf+o->len,path);
+    o->len += sprintf(o->buf+o->len,",\"entries\":[");
+    return 0;
+}
+
+static int
+json_line(struct LSOUT *o, struct myfile *f, time_t now, int n)
+{
+    if (0 == strcmp(f->n,".."))
+	return 0;
+    if (-1 == out_room(o, 2))
+	return -1;
+    o->len += sprintf(o->buf+o->len, n ? ",\n" : "\n");
+    if (-1 == json_entry(o,f))
+	return -1;
+    return 1;
+}
+
+/* "next" is the offset of the next page, if any */
+static int
+json_tail(struct LSOUT *o, struct DIRCACHE *dir, time_t now,
+	  int offset, int limit)
+{
+    if (-1 == out_room(o, LS_LINE_MAX))
+	return -1;
+    o->len += sprintf(o->buf+o->len,"\n],\"total\":%d",json_count(dir));
+    if (limit && limit < json_count(dir)-offset)
+	o->len += sprintf(o->buf+o->len,",\"next\":%d",offset+limit);
+    o->len += sprintf(o->buf+o->len,"}\n");
+    return 0;
+}
+
+/* ndjson: one object per line, nothing else */
+static int
+ndjson_head(struct LSOUT *o, struct DIRCACHE *dir, char *hostname, char *path)
+{
+    return 0;
+}
+
+static int
+ndjson_line(struct LSOUT *o, struct myfile *f, time_t now, int n)
+{
+    if (0 == strcmp(f->n,".."))
+	return 0;
+    if (-1 == json_entry(o,f))
+	return -1;
+    o->buf[o->len++] = '\n';
+    return 1;
+}
+
+static int
+ndjson_tail(struct LSOUT *o, struct DIRCACHE *dir, time_t now,
+	    int offset, int limit)
+{
+    return 0;
+}
+
+/* line() returns the number of entries it rendered, 0 or 1 */
+static struct LSFORMAT {
+    char  *mime;
+    int   (*head)(struct LSOUT *o, struct DIRCACHE *dir,
+		  char *hostname, char *path);
+    int   (*line)(struct LSOUT *o, struct myfile *f, time_t now, int n);
+    int   (*tail)(struct LSOUT *o, struct DIRCACHE *dir, time_t now,
+		  int offset, int limit);
+} ls_formats[LS_FORMATS] = {
+    [ LS_HTML   ] = { "text/html",            ls_head,     ls_line,     ls_tail     },
+    [ LS_JSON   ] = { "application/json",     json_head,   json_line,   json_tail   },
+    [ LS_NDJSON ] = { "application/x-ndjson", ndjson_head, ndjson_line, ndjson_tail },
+};
+
+/* scan and sort the directory into dir */
+static int
+ls(struct DIRCACHE *dir, char *filename, char *path)
+{
+    struct myarena arena = { NULL, 0, 0 };
+    int            count,i;
+    size_t         pos;
+
+    if (debug)
+	fprintf(stderr,"dir: reading %s\n",filename);
+    if (-1 == (count = scan_dir(filename,path,&arena))) {
+	free(arena.mem);
+	return -1;
+    }
+
+    /* sort */
+    if (count) {
+	if (NULL == (dir->files = malloc(count * sizeof(struct myfile*))))
+	    goto oom;
+	for (i = 0, pos = 0; i < count; i++) {
+	    dir->files[i] = (struct myfile*)(arena.mem + pos);
+	    pos += MYFILE_SIZE(dir->files[i]->n);
 	}
+	qsort(dir->files,count,sizeof(struct myfile*),compare_files);
     }
-    strftime(line,32,"%d/%b/%Y %H:%M:%S GMT",gmtime(&now));
-    len += sprintf(buf+len,
-		   "</pre><hr noshade size=1>\n"
-		   "<small><a href=\"%s\">%s</a> &nbsp; %s</small>\n"
-		   "</body>\n",
-		   HOMEPAGE,server_name,line);
-    for (i = 0; i < count; i++)
-	free(files[i]);
-    if (count)
-	free(files);
-
-    /* return results */
-    *length = len;
-    return buf;
+    dir->arena = arena.mem;
+    dir->count = count;
+    dir->size  = arena.size + count * sizeof(struct myfile*);
+    return 0;
 
  oom:
     fprintf(stderr,"oom\n");
-    if (files) {
-	for (i = 0; i < count; i++)
-	    if (files[i])
-		free(files[i]);
-	free(files);
-    }
-    if (buf)
-	free(buf);
-    return NULL;
+    free(arena.mem);
+    return -1;
+}
+
+/* render a small listing for the cache, returns the bytes used */
+static int
+ls_page(struct DIRCACHE *dir, int format, char *hostname, char *path)
+{
+    struct LSFORMAT *fmt = ls_formats + format;
+    struct LSOUT    out = { NULL, 0, 0 };
+    int             i,rc,n = 0;
+
+    if (-1 == out_room(&out, LS_LINE_MAX) ||
+	-1 == fmt->head(&out,dir,hostname,path))
+	goto oom;
+    for (i = 0; i < dir->count; i++) {
+	if (-1 == (rc = fmt->line(&out,dir->files[i],dir->add,n)))
+	    goto oom;
+	n += rc;
+    }
+    if (-1 == fmt->tail(&out,dir,dir->add,0,0))
+	goto oom;
+    dir->page[format]   = out.buf;
+    dir->length[format] = out.len;
+    return out.size;
+
+ oom:
+    fprintf(stderr,"oom\n");
+    free(out.buf);
+    return -1;
+}
+
+/* listing is sent while it is rendered (req->dir is set) */
+int
+ls_start(struct REQUEST *req, int offset, int limit)
+{
+    struct LISTING *l;
+    int count = req->dir->count;
+    int skip = 0;
+
+    if (NULL == (l = malloc(sizeof(*l))))
+	return -1;
+    memset(l,0,sizeof(*l));
+    if (LS_HTML != req->ls_format) {
+	/* json offsets count json entries, without ".." */
+	skip   = count - json_count(req->dir);
+	count -= skip;
+    }
+    /* client supplied, keep offset+limit in range */
+    if (offset < 0 || offset > count)
+	offset = offset < 0 ? 0 : count;
+    if (limit < 0)
+	limit = 0;
+    if (limit > count)
+	limit = count ? count : 1;
+    l->offset = offset;
+    l->limit  = limit;
+    l->pos    = skip + offset;
+    l->end    = skip + ((limit && limit < count - offset) ? offset + limit : count);
+    l->step   = LS_HEAD;
+    l->format = req->ls_format;
+    /* http/1.0: no chunks, the connection end marks the end */
+    l->chunked = (req->major > 1 || (1 == req->major && req->minor > 0));
+    if (!l->chunked)
+	req->keep_alive = 0;
+    req->ls = l;
+    return 0;
+}
+
+/* render the next chunk into req->ls->out, returns its size, 0: done */
+int
+ls_fill(struct REQUEST *req)
+{
+    struct LISTING  *l = req->ls;
+    struct LSFORMAT *fmt = ls_formats + l->format;
+    int start = l->chunked ? 10 : 0;    /* chunk size, "%08x\r\n" */
+    int rc = 0;
+
+    l->out.len  = start;
+    l->written  = 0;
+    if (-1 == out_room(&l->out, LS_CHUNK + LS_LINE_MAX))
+	return -1;
+    while (l->out.len < LS_CHUNK && l->step < LS_DONE && -1 != rc) {
+	switch (l->step) {
+	case LS_HEAD:
+	    rc = fmt->head(&l->out,req->dir,req->hostname,req->path);
+	    l->step = LS_ENTRIES;
+	    break;
+	case LS_ENTRIES:
+	    if (l->pos == l->end) {
+		l->step = LS_TAIL;
+		break;
+	    }
+	    rc = fmt->line(&l->out,req->dir->files[l->pos++],now,l->lines);
+	    if (rc > 0)
+		l->lines += rc;
+	    break;
+	case LS_TAIL:
+	    rc = fmt->tail(&l->out,req->dir,now,l->offset,l->limit);
+	    l->step = LS_DONE;
+	    break;
+	}
+    }
+    if (-1 == rc)
+	return -1;
+
+    if (l->out.len == start) {
+	if (!l->chunked || LS_END == l->step)
+	    return 0;
+	l->step = LS_END;
+	l->out.len = sprintf(l->out.buf,"0\r\n\r\n");
+	return l->out.len;
+    }
+    if (l->chunked) {
+	if (-1 == out_room(&l->out, 2))
+	    return -1;
+	sprintf(l->out.buf,"%08x\r",l->out.len - start);
+	l->out.buf[9] = '\n';
+	l->out.len += sprintf(l->out.buf+l->out.len,"\r\n");
+    }
+    return l->out.len;
+}
+
+void
+ls_free(struct REQUEST *req)
+{
+    if (NULL == req->ls)
+	return;
+    free(req->ls->out.buf);
+    free(req->ls);
+    req->ls = NULL;
 }
 
 /* --------------------------------------------------------- */
+/* listing cache: hashed, split into shards with their own lock and  */
+/* LRU list, bounded by entries (-a) and bytes (-D), both            */
+/* divided evenly among the shards.                                   */
+/* With inotify a watch on the directory marks the listing dirty.   */
+/* Listings are rebuilt when they are an hour old either way, that   */
+/* covers files written in place (no event until they are closed).   */
 
 #define MAX_CACHE_AGE   3600   /* seconds */
+#define DIR_SHARD_BITS  4
+#define DIR_SHARDS      (1 << DIR_SHARD_BITS)
+
+struct DIRSHARD {
+#ifdef USE_THREADS
+    pthread_mutex_t  lock;
+#endif
+    struct DIRCACHE  **buckets;
+    unsigned int     nbuckets;        /* power of two */
+    struct DIRCACHE  *lru_head;       /* most recently used */
+    struct DIRCACHE  *lru_tail;
+    int              count;
+    off_t            bytes;
+};
+
+static struct DIRSHARD shards[DIR_SHARDS];
+
+#ifdef HAVE_INOTIFY
+
+#define WATCH_BUCKETS   1024
+/* no IN_MODIFY, it fires on every write(); sizes and mtimes are
+   updated on IN_CLOSE_WRITE and IN_ATTRIB (utime, chmod) */
+#define WATCH_MASK      (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+			 IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | \
+			 IN_MOVE_SELF | IN_ONLYDIR)
+
+/* cached listings by watch descriptor (several paths may lead to the
+   same directory and share the wd), chained via DIRCACHE->wnext.
+   Lock order: shard, then watches. */
+static int              watch_fd = -1;
+static struct DIRCACHE  *watches[WATCH_BUCKETS];
+#ifdef USE_THREADS
+static pthread_mutex_t  lock_watch = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* shard is locked */
+static void
+dir_watch_add(struct DIRCACHE *dir)
+{
+    int wd;
+
+    dir->wd = -1;
+    if (-1 == watch_fd)
+	return;
+    wd = inotify_add_watch(watch_fd,dir->path,WATCH_MASK);
+    if (-1 == wd) {
+	if (debug)
+	    fprintf(stderr,"dir: can't watch %s: %s\n",
+		    dir->path,strerror(errno));
+	return;
+    }
+    DO_LOCK(lock_watch);
+    dir->wd = wd;
+    dir->wnext = watches[wd & (WATCH_BUCKETS-1)];
+    watches[wd & (WATCH_BUCKETS-1)] = dir;
+    DO_UNLOCK(lock_watch);
+}
 
-struct DIRCACHE *dirs = NULL;
+/* shard is locked */
+static void
+dir_watch_del(struct DIRCACHE *dir)
+{
+    struct DIRCACHE **p,*other;
+    int wd;
+
+    DO_LOCK(lock_watch);
+    wd = dir->wd;
+    if (-1 == wd) {
+	/* never watched, or the watch is gone already */
+	DO_UNLOCK(lock_watch);
+	return;
+    }
+    for (p = &watches[wd & (WATCH_BUCKETS-1)]; *p != dir; p = &(*p)->wnext)
+	;
+    *p = dir->wnext;
+    dir->wd = -1;
+    for (other = watches[wd & (WATCH_BUCKETS-1)]; other != NULL;
+	 other = other->wnext)
+	if (other->wd == wd)
+	    break;
+    if (NULL == other)
+	/* last user */
+	inotify_rm_watch(watch_fd,wd);
+    DO_UNLOCK(lock_watch);
+}
+
+/* watches are locked */
+static void
+dir_watch_event(struct inotify_event *ev)
+{
+    struct DIRCACHE **p,*dir;
+    int i;
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+	/* lost events, everything may be stale */
+	for (i = 0; i < WATCH_BUCKETS; i++)
+	    for (dir = watches[i]; dir != NULL; dir = dir->wnext)
+		__atomic_store_n(&dir->dirty,1,__ATOMIC_RELAXED);
+	return;
+    }
+    for (p = &watches[ev->wd & (WATCH_BUCKETS-1)]; NULL != (dir = *p);) {
+	if (dir->wd != ev->wd) {
+	    p = &dir->wnext;
+	    continue;
+	}
+	if (debug)
+	    fprintf(stderr,"dir: changed %s\n",dir->path);
+	__atomic_store_n(&dir->dirty,1,__ATOMIC_RELAXED);
+	if (ev->mask & IN_IGNORED) {
+	    /* directory deleted (or unmounted), watch is gone */
+	    *p = dir->wnext;
+	    dir->wd = -1;
+	    continue;
+	}
+	p = &dir->wnext;
+    }
+}
+
+/* read and apply pending events, returns -1 on error (or if there
+   are none with a non-blocking watch_fd) */
+static int
+dir_watch_read(void)
+{
+    char buf[4096]
+	__attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    int rc,pos;
+
+    rc = read(watch_fd,buf,sizeof(buf));
+    if (rc <= 0)
+	return -1;
+    DO_LOCK(lock_watch);
+    for (pos = 0; pos < rc; pos += sizeof(*ev) + ev->len) {
+	ev = (struct inotify_event*)(buf+pos);
+	dir_watch_event(ev);
+    }
+    DO_UNLOCK(lock_watch);
+    return 0;
+}
+
+#ifdef USE_THREADS
+static void*
+dir_watcher(void *arg)
+{
+    for (;;)
+	if (-1 == dir_watch_read() && EINTR != errno)
+	    break;
+    xperror(LOG_WARNING,"inotify read",NULL);
+    return NULL;
+}
+#endif
+
+static void
+dir_watch_init(void)
+{
+#ifdef USE_THREADS
+    pthread_t thread;
+
+    /* blocking reads in the watcher thread */
+    watch_fd = inotify_init1(IN_CLOEXEC);
+#else
+    /* get_dir() picks up the events */
+    watch_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+#endif
+    if (-1 == watch_fd) {
+	xperror(LOG_WARNING,"inotify_init (listings expire hourly)",NULL);
+	return;
+    }
+#ifdef USE_THREADS
+    if (0 != pthread_create(&thread,NULL,dir_watcher,NULL)) {
+	xperror(LOG_WARNING,"start inotify thread",NULL);
+	close(watch_fd);
+	watch_fd = -1;
+	return;
+    }
+    pthread_detach(thread);
+#endif
+}
+
+#else /* HAVE_INOTIFY */
+
+static void dir_watch_init(void) {}
+static void dir_watch_add(struct DIRCACHE *dir) { dir->wd = -1; }
+static void dir_watch_del(struct DIRCACHE *dir) {}
+
+#endif /* HAVE_INOTIFY */
+
+static void dir_scan_init(void);
+
+/* once, in the serving process */
+static void
+dircache_init(void)
+{
+#ifdef USE_THREADS
+    int i;
+
+    for (i = 0; i < DIR_SHARDS; i++)
+	pthread_mutex_init(&shards[i].lock,NULL);
+#endif
+    dir_watch_init();
+    dir_scan_init();
+}
+
+static unsigned int
+hash_dir(char *path)
+{
+    unsigned int h = 2166136261u;    /* FNV-1a */
+
+    for (; *path; path++) {
+	h ^= (unsigned char)*path;
+	h *= 16777619u;
+    }
+    return h;
+}
+
+static void
+dir_lru_unlink(struct DIRSHARD *s, struct DIRCACHE *dir)
+{
+    if (dir->prev)
+	dir->prev->next = dir->next;
+    else
+	s->lru_head = dir->next;
+    if (dir->next)
+	dir->next->prev = dir->prev;
+    else
+	s->lru_tail = dir->prev;
+    dir->prev = NULL;
+    dir->next = NULL;
+}
+
+static void
+dir_lru_push(struct DIRSHARD *s, struct DIRCACHE *dir)
+{
+    dir->prev = NULL;
+    dir->next = s->lru_head;
+    if (s->lru_head)
+	s->lru_head->prev = dir;
+    else
+	s->lru_tail = dir;
+    s->lru_head = dir;
+}
+
+/* drop the cache's reference, shard is locked */
+static void
+dir_remove(struct DIRSHARD *s, struct DIRCACHE *dir)
+{
+    struct DIRCACHE **p;
+
+    for (p = &s->buckets[dir->hash & (s->nbuckets-1)]; *p != dir;
+	 p = &(*p)->hnext)
+	;
+    *p = dir->hnext;
+    dir_watch_del(dir);
+    dir_lru_unlink(s,dir);
+    s->count--;
+    s->bytes -= dir->charged;
+    dir->cached = 0;
+    free_dir(dir);
+}
+
+static void
+dir_shrink(struct DIRSHARD *s, struct DIRCACHE *keep)
+{
+    int   max_count = (max_dircache + DIR_SHARDS-1) / DIR_SHARDS;
+    off_t max_bytes = dircache_max / DIR_SHARDS;
+
+    while ((s->count > max_count || s->bytes > max_bytes) &&
+	   NULL != s->lru_tail && keep != s->lru_tail) {
+	if (debug)
+	    fprintf(stderr,"dir: evict %s\n",s->lru_tail->path);
+	dir_remove(s,s->lru_tail);
+    }
+}
 
 void free_dir(struct DIRCACHE *dir)
 {
+    int i;
+
     DO_LOCK(dir->lock_refcount);
     dir->refcount--;
     if (dir->refcount > 0) {
@@ -417,88 +1100,321 @@ void free_dir(struct DIRCACHE *dir)
     FREE_LOCK(dir->lock_refcount);
     FREE_LOCK(dir->lock_reading);
     FREE_COND(dir->wait_reading);
-    if (NULL != dir->html)
-	free(dir->html);
+    for (i = 0; i < LS_FORMATS; i++)
+	free(dir->page[i]);
+    free(dir->files);
+    free(dir->arena);
+    free(dir->path);
     free(dir);
 }
 
-struct DIRCACHE*
-get_dir(struct REQUEST *req, char *filename)
+/* --------------------------------------------------------- */
+/* scan threads: a request for a directory which isn't cached yet   */
+/* is parked (no events, no timer), a scan thread reads and sorts   */
+/* the directory and hands it back to its event loop, along with    */
+/* the requests which asked for the same directory meanwhile.  The  */
+/* hand back works like the one of the handshake threads (ssl.c).   */
+
+#define SCAN_THREADS    2
+
+struct SCANJOB {
+    struct DIRCACHE  *dir;
+    char             *path;          /* of the parked request */
+    struct SCANJOB   *next;
+};
+
+static int              scan_threads;
+#ifdef USE_THREADS
+static pthread_mutex_t  lock_scan = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   scan_cond = PTHREAD_COND_INITIALIZER;
+static struct SCANJOB   *scans, *scans_tail;
+#endif
+
+/* push to the loop's list, only the push onto an empty list has
+   to wake it up, later ones find a wakeup pending */
+static void
+dir_hand_back(struct REQUEST *req)
+{
+    struct EVLOOP *loop = req->loop;
+    struct REQUEST *prev;
+
+    prev = __atomic_load_n(&loop->ls_done,__ATOMIC_RELAXED);
+    do {
+	req->ls_next = prev;
+    } while (!__atomic_compare_exchange_n(&loop->ls_done,&prev,req,1,
+					  __ATOMIC_RELEASE,
+					  __ATOMIC_RELAXED));
+    if (NULL == prev)
+	ev_wake(loop);
+}
+
+/* read a new cache entry, then release everybody waiting for it */
+static void
+dir_read(struct DIRCACHE *dir, char *path)
+{
+    struct DIRSHARD *s = shards + (dir->hash >> (32 - DIR_SHARD_BITS));
+    struct REQUEST *req,*next;
+
+    if (-1 == ls(dir,dir->path,path))
+	dir->count = -1;
+
+    /* account the index, make room */
+    DO_LOCK(s->lock);
+    if (dir->cached) {
+	dir->charged = dir->size;
+	s->bytes += dir->charged;
+    }
+    dir_shrink(s,dir);
+    DO_UNLOCK(s->lock);
+
+    DO_LOCK(dir->lock_reading);
+    dir->reading = 0;
+    BCAST_COND(dir->wait_reading);
+    req = dir->waiting;
+    dir->waiting = NULL;
+    DO_UNLOCK(dir->lock_reading);
+    for (; req != NULL; req = next) {
+	next = req->ls_next;
+	dir_hand_back(req);
+    }
+}
+
+/* park the request until dir is read, lock_reading is held */
+static int
+dir_park(struct DIRCACHE *dir, struct REQUEST *req)
+{
+    if (0 == scan_threads || -1 == req->loop->wakefd[1])
+	return -1;
+    req->ls_next = dir->waiting;
+    dir->waiting = req;
+    req->state = STATE_LS_SCAN;
+    return 0;
+}
+
+#ifdef USE_THREADS
+static void*
+dir_scanner(void *arg)
+{
+    struct SCANJOB *job;
+
+    for (;;) {
+	DO_LOCK(lock_scan);
+	while (NULL == scans)
+	    WAIT_COND(scan_cond,lock_scan);
+	job = scans;
+	scans = job->next;
+	if (NULL == scans)
+	    scans_tail = NULL;
+	DO_UNLOCK(lock_scan);
+
+	dir_read(job->dir,job->path);
+	free(job);
+    }
+    return NULL;
+}
+#endif
+
+/* queue a new cache entry for reading, the request parks until it
+   is done.  -1: read it yourself */
+static int
+dir_scan(struct DIRCACHE *dir, struct REQUEST *req)
+{
+#ifdef USE_THREADS
+    struct SCANJOB *job;
+    int rc;
+
+    if (NULL == (job = malloc(sizeof(*job))))
+	return -1;
+    DO_LOCK(dir->lock_reading);
+    rc = dir_park(dir,req);
+    DO_UNLOCK(dir->lock_reading);
+    if (-1 == rc) {
+	free(job);
+	return -1;
+    }
+    job->dir  = dir;
+    job->path = req->path;
+    job->next = NULL;
+    DO_LOCK(lock_scan);
+    if (scans_tail)
+	scans_tail->next = job;
+    else
+	scans = job;
+    scans_tail = job;
+    pthread_cond_signal(&scan_cond);
+    DO_UNLOCK(lock_scan);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+static void
+dir_scan_init(void)
 {
-    struct DIRCACHE  *this,*prev;
-    int              i;
-
-    DO_LOCK(lock_dircache);
-    for (prev = NULL, this = dirs, i=0; this != NULL;
-	 prev = this, this = this->next, i++) {
-	if (0 == strcmp(filename,this->path)) {
-	    /* remove from list */
-	    if (NULL == prev)
-		dirs = this->next;
-	    else
-		prev->next = this->next;
-	    if (debug)
-		fprintf(stderr,"dir: found %s\n",this->path);
+#ifdef USE_THREADS
+    pthread_t thread;
+    int i;
+
+    for (i = 0; i < SCAN_THREADS; i++) {
+	if (0 != pthread_create(&thread,NULL,dir_scanner,NULL)) {
+	    xperror(LOG_WARNING,"start scan thread",NULL);
 	    break;
 	}
-	if (i > max_dircache) {
-	    /* reached cache size limit -> free last element */
-#if 0
-	    if (this->next != NULL) {
-		fprintf(stderr,"panic: this should'nt happen (%s:%d)\n",
-			__FILE__, __LINE__);
-		exit(1);
-	    }
+	pthread_detach(thread);
+    }
+    scan_threads = i;
 #endif
-	    free_dir(this);
-	    this = NULL;
-	    prev->next = NULL;
-	    break;
+}
+
+/* take the requests the scan threads handed back, they continue
+   with dir_request() */
+struct REQUEST*
+ls_scan_done(struct EVLOOP *loop)
+{
+    if (NULL == __atomic_load_n(&loop->ls_done,__ATOMIC_RELAXED))
+	return NULL;
+    return __atomic_exchange_n(&loop->ls_done,NULL,__ATOMIC_ACQUIRE);
+}
+
+/*
+ * Look up the listing, read the directory if it isn't cached.  The
+ * request is parked (STATE_LS_SCAN) if the directory is read by a
+ * scan thread, either for this request or an earlier one.
+ */
+struct DIRCACHE*
+get_dir(struct REQUEST *req, char *filename)
+{
+    struct DIRCACHE  *this;
+    struct DIRSHARD  *s;
+    unsigned int     hash;
+    int              rc;
+
+#ifdef USE_THREADS
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&once,dircache_init);
+#else
+    static int once;
+
+    if (!once) {
+	dircache_init();
+	once = 1;
+    }
+# ifdef HAVE_INOTIFY
+    while (-1 != watch_fd && 0 == dir_watch_read())
+	;
+# endif
+#endif
+    hash = hash_dir(filename);
+    s = shards + (hash >> (32 - DIR_SHARD_BITS));
+
+    DO_LOCK(s->lock);
+    if (NULL == s->buckets) {
+	for (s->nbuckets = 16; s->nbuckets * DIR_SHARDS < max_dircache;
+	     s->nbuckets <<= 1)
+	    ;
+	s->buckets = calloc(s->nbuckets,sizeof(struct DIRCACHE*));
+	if (NULL == s->buckets) {
+	    DO_UNLOCK(s->lock);
+	    return NULL;
 	}
     }
+    for (this = s->buckets[hash & (s->nbuckets-1)]; this != NULL;
+	 this = this->hnext)
+	if (this->hash == hash && 0 == strcmp(filename,this->path))
+	    break;
     if (this) {
-	/* check mtime and cache entry age */
-	if (now - this->add > MAX_CACHE_AGE ||
+	/* changed (see above), or check mtime and cache entry age */
+	if (__atomic_load_n(&this->dirty,__ATOMIC_RELAXED) ||
+	    now - this->add > MAX_CACHE_AGE ||
 	    0 != strcmp(this->mtime, req->mtime)) {
-	    free_dir(this);
+	    dir_remove(s,this);
 	    this = NULL;
+	} else if (debug) {
+	    fprintf(stderr,"dir: found %s\n",this->path);
 	}
     }
     if (!this) {
-	/* add a new cache entry to the list */
+	/* add a new cache entry */
 	this = malloc(sizeof(struct DIRCACHE));
+	if (NULL == this) {
+	    DO_UNLOCK(s->lock);
+	    return NULL;
+	}
+	memset(this,0,sizeof(*this));
+	if (NULL == (this->path = strdup(filename))) {
+	    DO_UNLOCK(s->lock);
+	    free(this);
+	    return NULL;
+	}
+	this->hash = hash;
 	this->refcount = 2;
 	this->reading = 1;
+	this->cached = 1;
 	INIT_LOCK(this->lock_refcount);
 	INIT_LOCK(this->lock_reading);
 	INIT_COND(this->wait_reading);
-	this->next = dirs;
-	dirs = this;
-	DO_UNLOCK(lock_dircache);
+	this->hnext = s->buckets[hash & (s->nbuckets-1)];
+	s->buckets[hash & (s->nbuckets-1)] = this;
+	dir_lru_push(s,this);
+	s->count++;
+	/* before reading it, changes from now on must be seen */
+	dir_watch_add(this);
+	DO_UNLOCK(s->lock);
 
-	strcpy(this->path,  filename);
 	strcpy(this->mtime, req->mtime);
 	this->add   = now;
-	this->html  = ls(now,req->hostname,filename,req->path,&(this->length));
-
-	DO_LOCK(this->lock_reading);
-	this->reading = 0;
-	BCAST_COND(this->wait_reading);
-	DO_UNLOCK(this->lock_reading);
+	if (-1 == dir_scan(this,req))
+	    dir_read(this,req->path);
     } else {
-	/* add back to the list */
-	this->next = dirs;
-	dirs = this;
+	/* move to the front */
+	dir_lru_unlink(s,this);
+	dir_lru_push(s,this);
+	DO_LOCK(this->lock_refcount);
 	this->refcount++;
-	DO_UNLOCK(lock_dircache);
+	DO_UNLOCK(this->lock_refcount);
+	DO_UNLOCK(s->lock);
 
 	DO_LOCK(this->lock_reading);
+	rc = 0;
 	if (this->reading)
+	    rc = dir_park(this,req);
+	if (this->reading && -1 == rc)
 	    WAIT_COND(this->wait_reading,this->lock_reading);
 	DO_UNLOCK(this->lock_reading);
     }
-
-    req->body  = this->html;
-    req->lbody = this->length;
     return this;
 }
+
+/* the listing is read: point the body at the rendered page, if any */
+void
+ls_body(struct REQUEST *req)
+{
+    struct DIRCACHE  *this = req->dir;
+    struct DIRSHARD  *s = shards + (this->hash >> (32 - DIR_SHARD_BITS));
+    int              format = req->ls_format;
+    int              added;
+
+    /* small listings are kept rendered, each format on first use */
+    if (this->count >= 0 && this->count <= LS_INLINE) {
+	added = 0;
+	DO_LOCK(this->lock_reading);
+	if (NULL == this->page[format])
+	    added = ls_page(this,format,req->hostname,req->path);
+	DO_UNLOCK(this->lock_reading);
+	if (added > 0) {
+	    DO_LOCK(s->lock);
+	    if (this->cached) {
+		this->charged += added;
+		s->bytes += added;
+	    }
+	    dir_shrink(s,this);
+	    DO_UNLOCK(s->lock);
+	}
+    }
+
+    req->mime  = ls_formats[format].mime;
+    req->body  = this->page[format];
+    req->lbody = this->length[format];
+}
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/socket.h>
@@ -9,53 +10,147 @@
 
 #include "httpd.h"
 
+#define MIME_EXT  31                 /* longer extensions are ignored */
+
 /* ----------------------------------------------------------------- */
 
+/* open addressing, linear probing.  Keys are stored lower case,
+   the table is built once by init_mime() and read-only afterwards */
 struct MIME {
-    char  ext[8];
-    char  type[64];
+    char  *ext;                      /* NULL: free slot */
+    char  *type;
 };
 
 static char         *mime_default;
 static struct MIME  *mime_types;
+static unsigned int  mime_size;      /* power of two */
 static int           mime_count;
 
 /* ----------------------------------------------------------------- */
 
+/* lower case copy of ext into buf, -1 if it is too long */
+static int
+fold_ext(char *buf, char *ext)
+{
+    int i;
+
+    for (i = 0; ext[i]; i++) {
+	if (i == MIME_EXT)
+	    return -1;
+	buf[i] = tolower((unsigned char)ext[i]);
+    }
+    buf[i] = 0;
+    return i;
+}
+
+static unsigned int
+hash_ext(char *ext)
+{
+    unsigned int h = 2166136261u;    /* FNV-1a */
+
+    for (; *ext; ext++) {
+	h ^= (unsigned char)*ext;
+	h *= 16777619u;
+    }
+    return h;
+}
+
+static struct MIME*
+find_mime(char *ext)
+{
+    unsigned int i;
+
+    if (0 == mime_size)
+	return NULL;
+    for (i = hash_ext(ext) & (mime_size-1);
+	 NULL != mime_types[i].ext;
+	 i = (i+1) & (mime_size-1)) {
+	if (0 == strcmp(ext,mime_types[i].ext))
+	    return mime_types+i;
+    }
+    return mime_types+i;
+}
+
+static void
+grow_mime(void)
+{
+    struct MIME *old = mime_types;
+    unsigned int i,size = mime_size;
+
+    /* keep the load factor below 1/2 */
+    mime_size  = size ? size*2 : 256;
+    mime_types = malloc(mime_size*sizeof(struct MIME));
+    if (NULL == mime_types) {
+	perror("malloc");
+	exit(1);
+    }
+    memset(mime_types,0,mime_size*sizeof(struct MIME));
+    for (i = 0; i < size; i++)
+	if (old[i].ext)
+	    *find_mime(old[i].ext) = old[i];
+    free(old);
+}
+
 static void
 add_mime(char *ext, char *type)
 {
-    if (0 == (mime_count % 64))
-	mime_types = realloc(mime_types,(mime_count+64)*sizeof(struct MIME));
-    strcpy(mime_types[mime_count].ext, ext);
-    strcpy(mime_types[mime_count].type,type);
+    char key[MIME_EXT+1];
+    struct MIME *m;
+
+    if (fold_ext(key,ext) <= 0)
+	return;
+    if ((unsigned)(mime_count+1)*2 > mime_size)
+	grow_mime();
+    m = find_mime(key);
+    if (m->ext)
+	/* first one wins */
+	return;
+    m->ext  = strdup(key);
+    m->type = strdup(type);
     mime_count++;
 }
 
+static void
+free_mime(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < mime_size; i++) {
+	free(mime_types[i].ext);
+	free(mime_types[i].type);
+    }
+    free(mime_types);
+    free(mime_default);
+    mime_types = NULL;
+    mime_size  = 0;
+    mime_count = 0;
+}
+
 char*
 get_mime(char *file)
 {
-    int i;
+    char key[MIME_EXT+1];
+    struct MIME *m;
     char *ext;
 
     ext = strrchr(file,'.');
-    if (NULL == ext)
+    if (NULL == ext || strchr(ext,'/'))
 	return mime_default;
-    ext++;
-    for (i = 0; i < mime_count; i++) {
-	if (0 == strcasecmp(ext,mime_types[i].ext))
-	    return mime_types[i].type;
-    }
-    return mime_default;
+    if (fold_ext(key,ext+1) <= 0)
+	return mime_default;
+    m = find_mime(key);
+    if (NULL == m || NULL == m->ext)
+	return mime_default;
+    return m->type;
 }
 
 void
 init_mime(char *file,char *def)
 {
     FILE *fp;
-    char line[128], type[64], ext[8];
-    int  len,off;
+    char line[1024], *type, *ext, *save;
 
+    free_mime();
     mime_default = strdup(def);
     if (NULL == (fp = fopen(file,"r"))) {
 	/* Add basic mime types as fallback when file doesn't exist */
@@ -63,6 +158,7 @@ init_mime(char *file,char *def)
 	add_mime("htm",  "text/html");
 	add_mime("css",  "text/css");
 	add_mime("js",   "application/javascript");
+	add_mime("mjs",  "application/javascript");
 	add_mime("json", "application/json");
 	add_mime("txt",  "text/plain");
 	add_mime("xml",  "text/xml");
@@ -70,32 +166,33 @@ init_mime(char *file,char *def)
 	add_mime("jpeg", "image/jpeg");
 	add_mime("png",  "image/png");
 	add_mime("gif",  "image/gif");
+	add_mime("webp", "image/webp");
 	add_mime("ico",  "image/x-icon");
 	add_mime("pdf",  "application/pdf");
 	add_mime("zip",  "application/zip");
 	add_mime("gz",   "application/gzip");
+	add_mime("wasm", "application/wasm");
 	add_mime("mp3",  "audio/mpeg");
 	add_mime("mp4",  "video/mp4");
 	add_mime("webm", "video/webm");
 	add_mime("svg",  "image/svg+xml");
 	add_mime("woff", "font/woff");
 	add_mime("woff2","font/woff2");
+	add_mime("geojson",     "application/geo+json");
+	add_mime("webmanifest", "application/manifest+json");
 	if (debug)
 	    fprintf(stderr,"warning: %s not found, using built-in mime types\n",file);
 	return;
     }
-    while (NULL != fgets(line,127,fp)) {
+    while (NULL != fgets(line,sizeof(line),fp)) {
 	if (line[0] == '#')
 	    continue;
-	if (1 != sscanf(line,"%63s%n",type,&len))
+	if (NULL == (type = strtok_r(line," \t\r\n",&save)))
 	    continue;
-	off = len;
-	for (;;) {
-	    if (1 != sscanf(line+off,"%7s%n",ext,&len))
-		break;
-	    off += len;
+	while (NULL != (ext = strtok_r(NULL," \t\r\n",&save)))
 	    add_mime(ext,type);
-	}
     }
     fclose(fp);
+    if (debug)
+	fprintf(stderr,"%s: %d extensions\n",file,mime_count);
 }
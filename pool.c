@@ -0,0 +1,86 @@
+/*
+ * object pools -- fixed size objects, carved out of slabs, recycled
+ * through a free list.  Not locked, each event loop owns its pools.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "httpd.h"
+
+struct SLAB {
+    struct SLAB *next;
+    char        pad[POOL_ALIGN - sizeof(struct SLAB*)];
+};
+
+/* ---------------------------------------------------------------------- */
+
+void
+pool_init(struct POOL *p, char *name, size_t size, size_t clear)
+{
+    memset(p,0,sizeof(*p));
+    p->name  = name;
+    p->size  = (size + POOL_ALIGN-1) & ~(size_t)(POOL_ALIGN-1);
+    p->clear = clear;
+}
+
+void*
+pool_get(struct POOL *p)
+{
+    struct SLAB *slab;
+    char *obj;
+    int i;
+
+    p->gets++;
+    if (NULL == p->free) {
+	/* refill */
+	slab = malloc(sizeof(struct SLAB) + POOL_SLAB * p->size);
+	if (NULL == slab)
+	    return NULL;
+	slab->next = p->slabs;
+	p->slabs = slab;
+	p->nslabs++;
+	obj = (char*)(slab+1);
+	for (i = POOL_SLAB-1; i > 0; i--) {
+	    *(void**)(obj + i * p->size) = p->free;
+	    p->free = obj + i * p->size;
+	}
+	p->nfree += POOL_SLAB-1;
+    } else {
+	p->hits++;
+	obj = p->free;
+	p->free = *(void**)obj;
+	p->nfree--;
+    }
+    if (++p->inuse > p->peak)
+	p->peak = p->inuse;
+    memset(obj,0,p->clear);
+    return obj;
+}
+
+void
+pool_put(struct POOL *p, void *obj)
+{
+    *(void**)obj = p->free;
+    p->free = obj;
+    p->nfree++;
+    p->inuse--;
+}
+
+void
+pool_stats(struct POOL *p, char *who)
+{
+    char msg[256];
+
+    snprintf(msg,sizeof(msg),"%s pool %s: %lu gets, %lu%% hits, "
+	     "%d in use, %d peak, %d free, %lu kB",
+	     who, p->name, p->gets,
+	     p->gets ? p->hits * 100 / p->gets : 0,
+	     p->inuse, p->peak, p->nfree,
+	     (unsigned long)p->nslabs * POOL_SLAB * p->size / 1024);
+    xerror(LOG_NOTICE,msg,NULL);
+}
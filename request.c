@@ -7,6 +7,7 @@
 #include <syslog.h>
 #include <time.h>
 #include <ctype.h>
+#include <limits.h>
 #include <pwd.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -17,18 +18,49 @@
 
 /* ---------------------------------------------------------------------- */
 
+/*
+ * Look for the blank line ending the header in buf[0..len), buf[len]
+ * must be 0.  Only bytes from 'from' on are new, everything before was
+ * checked by an earlier call.  glibc picks a SSE2/AVX2/EVEX strstr()
+ * at runtime, it beats scanning line by line with memchr() or a hand
+ * written SIMD loop, see bench/hdrscan.c.  Terminates the header,
+ * returns its length or 0 if it is incomplete.
+ */
+static int
+header_end(char *buf, int from, int len)
+{
+    char *start = buf + (from > 2 ? from-2 : 0);
+    char *crlf, *lf;
+
+    if (NULL != (crlf = strstr(start,"\n\r\n")))
+	/* \r\n\r\n, also ends the search below */
+	crlf[1] = 0;
+    if (NULL != (lf = strstr(start,"\n\n"))) {
+	/* \n\n, before any \r\n\r\n */
+	if (crlf)
+	    crlf[1] = '\r';
+	lf[1] = 0;
+	return lf+2 - buf;
+    }
+    if (crlf)
+	return crlf+3 - buf;
+    return 0;
+}
+
 void
 read_request(struct REQUEST *req, int pipelined)
 {
     int             rc;
-    char            *h;
 
  restart:
+    if (req->ev_done)
+	/* the event engine read for us already */
+	rc = ev_result(req);
 #ifdef USE_SSL
-    if (with_ssl)
+    else if (with_ssl)
 	rc = ssl_read(req, req->hreq + req->hdata, MAX_HEADER - req->hdata);
-    else
 #endif
+    else
 	rc = read(req->fd, req->hreq + req->hdata, MAX_HEADER - req->hdata);
     switch (rc) {
     case -1:
@@ -40,42 +72,36 @@ read_request(struct REQUEST *req, int pipelined)
 	}
 	if (errno == EINTR)
 	    goto restart;
-	xperror(LOG_INFO,"read",req->peerhost);
+	xperror(LOG_INFO,"read",req_peerhost(req));
 	/* fall through */
     case 0:
 	req->state = STATE_CLOSE;
 	return;
     default:
 	req->hdata += rc;
-	req->hreq[req->hdata] = 0;
     }
+    /* also after a pipelined request was moved down */
+    req->hreq[req->hdata] = 0;
 
     /* check if this looks like a http request after
        the first few bytes... */
     if (req->hdata < 5)
 	return;
-    if (strncmp(req->hreq,"GET ",4)  != 0  &&
+    if (0 == req->hscan &&
+	strncmp(req->hreq,"GET ",4)  != 0  &&
 	strncmp(req->hreq,"PUT ",4)  != 0  &&
 	strncmp(req->hreq,"HEAD ",5) != 0  &&
 	strncmp(req->hreq,"POST ",5) != 0) {
 	mkerror(req,400,0);
 	return;
     }
-    
+
     /* header complete ?? */
-    if (NULL != (h = strstr(req->hreq,"\r\n\r\n")) ||
-	NULL != (h = strstr(req->hreq,"\n\n"))) {
-	if (*h == '\r') {
-	    h += 4;
-	    *(h-2) = 0;
-	} else {
-	    h += 2;
-	    *(h-1) = 0;
-	}
-	req->lreq  = h - req->hreq;
+    if (0 != (req->lreq = header_end(req->hreq, req->hscan, req->hdata))) {
 	req->state = STATE_PARSE_HEADER;
 	return;
     }
+    req->hscan = req->hdata;
 
     if (req->hdata == MAX_HEADER) {
 	/* oops: buffer full, but found no complete request ... */
@@ -87,47 +113,6 @@ read_request(struct REQUEST *req, int pipelined)
 
 /* ---------------------------------------------------------------------- */
 
-#if 0
-static time_t
-parse_date(char *line)
-{
-    static char *m[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
-			 "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
-    char month[4];
-    struct tm tm;
-    int i;
-
-    line = strchr(line,' '); /* skip weekday */
-    if (NULL == line)
-	return -1;
-    line++;
-
-    /* first: RFC 1123 date ... */
-    if (6 != sscanf(line,"%2d %3s %4d %2d:%2d:%2d GMT",
-		    &tm.tm_mday,month,&tm.tm_year,
-		    &tm.tm_hour,&tm.tm_min,&tm.tm_sec))
-	/* second: RFC 1036 date ... */
-	if (6 != sscanf(line,"%2d-%3s-%2d %2d:%2d:%2d GMT",
-			&tm.tm_mday,month,&tm.tm_year,
-			&tm.tm_hour,&tm.tm_min,&tm.tm_sec))
-	    /* third: asctime() format */
-	    if (6 != sscanf(line,"%3s %2d %2d:%2d:%2d %4d",
-			    month,&tm.tm_mday,
-			    &tm.tm_hour,&tm.tm_min,&tm.tm_sec,
-			    &tm.tm_year))
-		/* none worked :-( */
-		return -1;
-    for (i = 0; i <= 11; i++)
-	if (0 == strcmp(month,m[i]))
-	    break;
-    tm.tm_mon = i;
-    if (tm.tm_year > 1900)
-	tm.tm_year -= 1900;
-
-    return mktime(&tm);
-}
-#endif
-
 static off_t
 parse_off_t(char *str, int *pos)
 {
@@ -245,6 +230,35 @@ unquote(unsigned char *path, unsigned char *qs, unsigned char *src)
     *dst = 0;
 }
 
+/* value of a query parameter, NULL if missing */
+static char*
+query_value(char *query, char *name)
+{
+    int len = strlen(name);
+    char *p;
+
+    for (p = query; p && *p; p = strchr(p,'&'), p = p ? p+1 : NULL)
+	if (0 == strncmp(p,name,len) && '=' == p[len])
+	    return p+len+1;
+    return NULL;
+}
+
+/* numeric query parameter, -1 if missing or out of range */
+static int
+query_int(char *query, char *name)
+{
+    char *p = query_value(query,name);
+    long val;
+
+    if (NULL == p || !isdigit(*p))
+	return -1;
+    errno = 0;
+    val = strtol(p,NULL,10);
+    if (ERANGE == errno || val > INT_MAX)
+	return -1;
+    return val;
+}
+
 /* delete unneeded path elements */
 static void
 fixpath(char *path)
@@ -347,47 +361,438 @@ static int sanity_checks(struct REQUEST *req)
     return 0;
 }
 
+/* ---------------------------------------------------------------------- */
+/* tokenizer                                                              */
+
+struct TOKEN {
+    char *p;
+    int  len;
+};
+
+#define HDR_HOST            1
+#define HDR_CONNECTION      2
+#define HDR_RANGE           3
+#define HDR_IF_MOD_SINCE    4
+#define HDR_IF_UNMOD_SINCE  5
+#define HDR_IF_RANGE        6
+#define HDR_AUTHORIZATION   7
+#define HDR_ACCEPT_ENCODING 8
+#define HDR_IF_MATCH        9
+#define HDR_IF_NONE_MATCH  10
+#define HDR_ACCEPT         11
+
+/* perfect hash of the header names we care about:
+   (len*4 + first + last char, lowercased) & 15 */
+#define HDR_HASH(n,l)	(((l)*4 + ((n)[0] | 0x20) + ((n)[(l)-1] | 0x20)) & 15)
+
+static struct HDRNAME {
+    char *name;
+    int  len;
+    int  id;
+} hdr_names[16] = {
+    [  1 ] = { "If-Match",             8, HDR_IF_MATCH       },
+    [  2 ] = { "If-Modified-Since",   17, HDR_IF_MOD_SINCE   },
+    [  3 ] = { "Authorization",       13, HDR_AUTHORIZATION  },
+    [  4 ] = { "Accept-Encoding",     15, HDR_ACCEPT_ENCODING },
+    [  5 ] = { "If-None-Match",       13, HDR_IF_NONE_MATCH  },
+    [  9 ] = { "Connection",          10, HDR_CONNECTION     },
+    [ 10 ] = { "If-Unmodified-Since", 19, HDR_IF_UNMOD_SINCE },
+    [ 11 ] = { "Range",                5, HDR_RANGE          },
+    [ 12 ] = { "Host",                 4, HDR_HOST           },
+    [ 13 ] = { "Accept",               6, HDR_ACCEPT         },
+    [ 14 ] = { "If-Range",             8, HDR_IF_RANGE       },
+};
+
+static int
+header_id(char *name, int len)
+{
+    struct HDRNAME *h;
+
+    if (0 == len)
+	return 0;
+    h = &hdr_names[HDR_HASH(name,len)];
+    if (h->len != len || 0 != strncasecmp(h->name,name,len))
+	return 0;
+    return h->id;
+}
+
+static int
+is_host_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+	(c >= '0' && c <= '9') || c == '.' || c == '-';
+}
+
+static int
+parse_int(char **p)
+{
+    int value = 0;
+
+    while (isdigit((unsigned char)**p)) {
+	value = value * 10 + **p - '0';
+	(*p)++;
+    }
+    return value;
+}
+
+static struct ENCODING {
+    int  flag;
+    char *name;
+    char *ext;
+} encodings[] = {
+    /* in order of preference */
+    { ENC_BR,    "br",    ".br"  },
+    { ENC_ZSTD,  "zstd",  ".zst" },
+    { ENC_GZIP,  "gzip",  ".gz"  },
+};
+#define NENCODINGS (sizeof(encodings)/sizeof(encodings[0]))
+
+/* "gzip, deflate;q=0.5, br" => ENC_* bits, q=0 excludes */
+static int
+parse_accept_encoding(char *p)
+{
+    struct TOKEN enc;
+    int i, flags = 0, flag;
+
+    for (;;) {
+	while (*p == ' ' || *p == '\t' || *p == ',')
+	    p++;
+	if (0 == *p)
+	    break;
+	for (enc.p = p; *p && *p != ',' && *p != ';' &&
+		 *p != ' ' && *p != '\t'; p++)
+	    ;
+	enc.len = p - enc.p;
+	if (enc.len == 6 && 0 == strncasecmp(enc.p,"x-gzip",6)) {
+	    enc.p += 2;
+	    enc.len = 4;
+	}
+	flag = 0;
+	if (enc.len == 1 && enc.p[0] == '*')
+	    flag = ENC_GZIP | ENC_BR | ENC_ZSTD;
+	for (i = 0; i < NENCODINGS; i++)
+	    if (enc.len == strlen(encodings[i].name) &&
+		0 == strncasecmp(enc.p,encodings[i].name,enc.len))
+		flag = encodings[i].flag;
+	for (; *p && *p != ','; p++) {
+	    if (0 == strncasecmp(p,"q=0",3) && strspn(p+3,".0") == strcspn(p+3,", \t;"))
+		/* q=0, q=0.0, ... -- not acceptable */
+		flag = 0;
+	}
+	flags |= flag;
+    }
+    return flags;
+}
+
+/* directory listing formats, by media type and ?format= */
+static struct LSTYPE {
+    char *type;
+    char *name;
+    int  format;
+} ls_types[] = {
+    { "text/html",            "html",   LS_HTML   },
+    { "application/json",     "json",   LS_JSON   },
+    { "application/x-ndjson", "ndjson", LS_NDJSON },
+    { "application/ndjson",   NULL,     LS_NDJSON },
+};
+#define NLSTYPES (sizeof(ls_types)/sizeof(ls_types[0]))
+
+/* "application/json, text/html;q=0.9" => LS_*, the first listing
+   format named wins, q values other than 0 are not compared */
+static int
+parse_accept(char *p)
+{
+    struct TOKEN type;
+    int i, format;
+
+    for (;;) {
+	while (*p == ' ' || *p == '\t' || *p == ',')
+	    p++;
+	if (0 == *p)
+	    break;
+	for (type.p = p; *p && *p != ',' && *p != ';' &&
+		 *p != ' ' && *p != '\t'; p++)
+	    ;
+	type.len = p - type.p;
+	format = -1;
+	for (i = 0; i < NLSTYPES; i++)
+	    if (type.len == strlen(ls_types[i].type) &&
+		0 == strncasecmp(type.p,ls_types[i].type,type.len))
+		format = ls_types[i].format;
+	for (; *p && *p != ','; p++) {
+	    if (0 == strncasecmp(p,"q=0",3) && strspn(p+3,".0") == strcspn(p+3,", \t;"))
+		/* q=0, q=0.0, ... -- not acceptable */
+		format = -1;
+	}
+	if (-1 != format)
+	    return format;
+    }
+    return LS_HTML;
+}
+
+/* ?format=json, -1 if not given or unknown */
+static int
+query_format(char *query)
+{
+    char *p = query_value(query,"format");
+    int i, len;
+
+    if (NULL == p)
+	return -1;
+    len = strcspn(p,"&");
+    for (i = 0; i < NLSTYPES; i++)
+	if (ls_types[i].name && len == strlen(ls_types[i].name) &&
+	    0 == strncmp(p,ls_types[i].name,len))
+	    return ls_types[i].format;
+    return -1;
+}
+
+/* METHOD SP request-target SP HTTP/x.y */
+static int
+parse_request_line(struct REQUEST *req, char *p)
+{
+    struct TOKEN method,target,host;
+    char *q;
+
+    for (method.p = p; *p >= 'A' && *p <= 'Z'; p++)
+	;
+    method.len = p - method.p;
+    while (*p == ' ' || *p == '\t')
+	p++;
+    for (target.p = p; *p && *p != ' ' && *p != '\t' &&
+	     *p != '\r' && *p != '\n'; p++)
+	;
+    target.len = p - target.p;
+    while (*p == ' ' || *p == '\t')
+	p++;
+    if (0 == method.len || method.len > MAX_MISC ||
+	0 == target.len || target.len > MAX_PATH ||
+	0 != strncmp(p,"HTTP/",5) || !isdigit((unsigned char)p[5]))
+	return -1;
+    p += 5;
+    req->major = parse_int(&p);
+    if (*p != '.' || !isdigit((unsigned char)p[1]))
+	return -1;
+    p++;
+    req->minor = parse_int(&p);
+
+    memcpy(req->type,method.p,method.len);
+    req->type[method.len] = 0;
+
+    if (target.p[0] != '/') {
+	/* absolute uri: scheme://host[:port]path */
+	for (q = target.p; isalpha((unsigned char)*q); q++)
+	    ;
+	if (q == target.p || 0 != strncmp(q,"://",3))
+	    return -1;
+	if (q - target.p != 4 || 0 != strncasecmp(target.p,"http",4))
+	    return -1;
+	for (host.p = q = q+3; is_host_char(*q); q++)
+	    ;
+	host.len = q - host.p;
+	if (0 == host.len || host.len > MAX_HOST)
+	    return -1;
+	if (*q == ':') {
+	    for (q++; isdigit((unsigned char)*q); q++)
+		;
+	}
+	if (q == target.p + target.len)
+	    return -1;
+	memcpy(req->hostname,host.p,host.len);
+	req->hostname[host.len] = 0;
+	target.len -= q - target.p;
+	target.p = q;
+    }
+    memcpy(req->uri,target.p,target.len);
+    req->uri[target.len] = 0;
+    return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+/* conditional requests                                                   */
+
+/*
+ * Is etag in the list ('"a", W/"b"' or '*')?  The weak comparison
+ * ignores W/ prefixes, the strong one never matches weak tags.
+ */
+static int
+etag_match(char *list, char *etag, int weak)
+{
+    struct TOKEN tag;
+    int etag_weak, tag_weak, len;
+    char *end;
+
+    etag_weak = (0 == strncmp(etag,"W/",2));
+    if (etag_weak)
+	etag += 2;
+    len = strlen(etag);
+    for (;;) {
+	while (*list == ' ' || *list == '\t' || *list == ',')
+	    list++;
+	if (0 == *list)
+	    return 0;
+	if (*list == '*')
+	    return 1;
+	tag.p = list;
+	tag_weak = (0 == strncmp(tag.p,"W/",2));
+	if (tag_weak)
+	    tag.p += 2;
+	if (*tag.p != '"' || NULL == (end = strchr(tag.p+1,'"')))
+	    /* malformed */
+	    return 0;
+	tag.len = end+1 - tag.p;
+	if ((weak || (!etag_weak && !tag_weak)) &&
+	    len && tag.len == len && 0 == strncmp(tag.p,etag,len))
+	    return 1;
+	list = end+1;
+    }
+}
+
+/* RFC 9110, 13.2.2: returns 0 (go ahead), 304 or 412 */
+static int
+preconditions(struct REQUEST *req, time_t mtime)
+{
+    time_t t;
+
+    if (req->if_match) {
+	if (!etag_match(req->if_match, req->etag, 0))
+	    return 412;
+    } else if (req->if_unmodified) {
+	t = parse_date(req->if_unmodified);
+	if (-1 != t && mtime > t)
+	    return 412;
+    }
+    if (req->if_none_match) {
+	if (etag_match(req->if_none_match, req->etag, 1))
+	    return 304;
+    } else if (req->if_modified) {
+	t = parse_date(req->if_modified);
+	if (-1 != t && mtime <= t)
+	    return 304;
+    }
+    return 0;
+}
+
+/* If-Range: an entity tag (strong comparison) or the exact date */
+static int
+if_range_ok(struct REQUEST *req, time_t mtime)
+{
+    char *v = req->if_range;
+
+    if (v[0] == '"' || 0 == strncmp(v,"W/",2))
+	return etag_match(v, req->etag, 0);
+    return parse_date(v) == mtime;
+}
+
+/* open the file to send, via the file cache if enabled */
+static int
+open_body(struct REQUEST *req, char *filename)
+{
+    if (fcache_max > 0) {
+	if (NULL == (req->fc = fcache_get(filename)))
+	    return -1;
+	req->bfd = req->fc->fd;
+	req->bst = req->fc->st;
+	return 0;
+    }
+    if (-1 == (req->bfd = open(filename,O_RDONLY)))
+	return -1;
+    close_on_exec(req->bfd);
+    fstat(req->bfd,&(req->bst));
+    return 0;
+}
+
+/* swap in a precompressed copy (file.br, ...) the client accepts,
+   unless it is older than the original */
+static void
+find_encoded(struct REQUEST *req, char *filename)
+{
+    struct FCACHE *fc = req->fc;
+    struct stat bst = req->bst;
+    int bfd = req->bfd, len = strlen(filename), i;
+
+    if (len + 4 > MAX_PATH)
+	return;
+    /* the answer depends on Accept-Encoding now, whatever we find */
+    req->vary = 1;
+    for (i = 0; i < NENCODINGS; i++) {
+	if (!(req->accept_enc & encodings[i].flag))
+	    continue;
+	strcpy(filename+len,encodings[i].ext);
+	if (0 == open_body(req,filename)) {
+	    if (S_ISREG(req->bst.st_mode) &&
+		req->bst.st_mtime >= bst.st_mtime) {
+		/* use it, drop the original */
+		if (fc)
+		    fcache_release(fc);
+		else
+		    close(bfd);
+		req->encoding = encodings[i].name;
+		if (debug)
+		    fprintf(stderr,"%03d: encoding: %s\n",req->fd,req->encoding);
+		break;
+	    }
+	    fcache_close(req);
+	}
+	req->fc  = fc;
+	req->bfd = bfd;
+	req->bst = bst;
+    }
+    filename[len] = 0;
+}
+
+/* the rest of parse_request() for a directory, once it is read */
+void
+dir_request(struct REQUEST *req)
+{
+    int rc, offset, limit;
+
+    if (NULL == req->dir || -1 == req->dir->count) {
+	/* We arrive here if opendir failed, probably due to -EPERM
+	 * It does exist (see the stat() call in parse_request()) */
+	mkerror(req,403,1);
+	return;
+    }
+    ls_body(req);
+    if (412 == (rc = preconditions(req, req->bst.st_mtime))) {
+	mkerror(req,412,1);
+	return;
+    } else if (304 == rc) {
+	/* 304 not modified */
+	mkheader(req,304);
+	req->head_only = 1;
+	return;
+    }
+    /* 200 OK -- big ones and pages are rendered while sending */
+    offset = query_int(req->query,"offset");
+    limit  = query_int(req->query,"limit");
+    if (NULL == req->body || offset >= 0 || limit >= 0) {
+	req->body = NULL;
+	if (-1 == ls_start(req,offset,limit)) {
+	    mkerror(req,500,0);
+	    return;
+	}
+    }
+    mkheader(req,200);
+}
+
 void
 parse_request(struct REQUEST *req)
 {
-    char filename[MAX_PATH+1], proto[MAX_MISC+1], *h;
-    int  port, rc, len;
+    char filename[MAX_PATH+1], *h, *line, *next, *eol;
+    struct TOKEN name, value;
+    time_t mtime;
+    int  rc, len;
     struct passwd *pw=NULL;
     
     if (debug > 2)
 	fprintf(stderr,"%s\n",req->hreq);
 
-    /* parse request. Hehe, scanf is powerfull :-) */
-    if (4 != sscanf(req->hreq,
-		    "%" S(MAX_MISC) "[A-Z] "
-		    "%" S(MAX_PATH) "[^ \t\r\n] HTTP/%d.%d",
-		    req->type, filename, &(req->major),&(req->minor))) {
+    /* parse request */
+    if (0 != parse_request_line(req,req->hreq)) {
 	mkerror(req,400,0);
 	return;
     }
-    if (filename[0] == '/') {
-	strncpy(req->uri,filename,sizeof(req->uri)-1);
-    } else {
-	port = 0;
-	*proto = 0;
-	if (4 != sscanf(filename,
-			"%" S(MAX_MISC) "[a-zA-Z]://"
-			"%" S(MAX_HOST) "[a-zA-Z0-9.-]:%d"
-			"%" S(MAX_PATH) "[^ \t\r\n]",
-			proto, req->hostname, &port, req->uri) &&
-	    3 != sscanf(filename,
-			"%" S(MAX_MISC) "[a-zA-Z]://"
-			"%" S(MAX_HOST) "[a-zA-Z0-9.-]"
-			"%" S(MAX_PATH) "[^ \t\r\n]",
-			proto, req->hostname, req->uri)) {
-	    mkerror(req,400,0);
-	    return;
-	}
-	if (*proto != 0 && 0 != strcasecmp(proto,"http")) {
-	    mkerror(req,400,0);
-	    return;
-	}
-    }
 
     unquote((unsigned char *)req->path,(unsigned char *)req->query,(unsigned char *)req->uri);
     fixpath(req->path);
@@ -405,45 +810,77 @@ parse_request(struct REQUEST *req)
 	req->head_only = 1;
     }
 
-    /* parse header lines */
+    /* parse header lines, in one pass, in place */
     req->keep_alive = req->minor;
-    for (h = req->hreq; h - req->hreq < req->lreq;) {
-	h = strchr(h,'\n');
-	if (NULL == h)
+    for (h = strchr(req->hreq,'\n'); NULL != h; h = next) {
+	line = h+1;
+	next = strchr(line,'\n');
+	eol  = next ? next : line + strlen(line);
+	if (eol > line && eol[-1] == '\r')
+	    eol--;
+	*eol = 0;
+	if (eol == line)
+	    /* end of header */
 	    break;
-	h++;
-
-	h[-2] = 0;
-	h[-1] = 0;
-	list_add(&req->header,h,0);
-
-	if (0 == strncasecmp(h,"Connection: ",12)) {
-	    req->keep_alive = (0 == strncasecmp(h+12,"Keep-Alive",10));
-
-	} else if (0 == strncasecmp(h,"Host: ",6)) {
-	    if (2 != sscanf(h+6,"%" S(MAX_HOST) "[a-zA-Z0-9.-]:%d",
-			    req->hostname,&port))
-		sscanf(h+6,"%" S(MAX_HOST) "[a-zA-Z0-9.-]",
-		       req->hostname);
+	list_add(&req->header,line,0);
 
-	} else if (0 == strncasecmp(h,"If-Modified-Since: ",19)) {
-	    req->if_modified = h+19;
-
-	} else if (0 == strncasecmp(h,"If-Unmodified-Since: ",21)) {
-	    req->if_unmodified = h+21;
-
-	} else if (0 == strncasecmp(h,"If-Range: ",10)) {
-	    req->if_range = h+10;
+	for (name.p = line; *line && *line != ':'; line++)
+	    ;
+	if (*line != ':')
+	    continue;
+	name.len = line - name.p;
+	for (line++; *line == ' ' || *line == '\t'; line++)
+	    ;
+	value.p   = line;
+	value.len = eol - line;
 
-	} else if (0 == strncasecmp(h,"Authorization: Basic ",21)) {
-	    decode_base64((unsigned char *)req->auth,(unsigned char *)(h+21),sizeof(req->auth)-1);
+	switch (header_id(name.p,name.len)) {
+	case HDR_CONNECTION:
+	    req->keep_alive = (0 == strncasecmp(value.p,"Keep-Alive",10));
+	    break;
+	case HDR_HOST:
+	    for (len = 0; len < value.len && len < MAX_HOST &&
+		     is_host_char(value.p[len]); len++)
+		;
+	    if (len) {
+		memcpy(req->hostname,value.p,len);
+		req->hostname[len] = 0;
+	    }
+	    break;
+	case HDR_IF_MOD_SINCE:
+	    req->if_modified = value.p;
+	    break;
+	case HDR_IF_UNMOD_SINCE:
+	    req->if_unmodified = value.p;
+	    break;
+	case HDR_IF_RANGE:
+	    req->if_range = value.p;
+	    break;
+	case HDR_IF_MATCH:
+	    req->if_match = value.p;
+	    break;
+	case HDR_IF_NONE_MATCH:
+	    req->if_none_match = value.p;
+	    break;
+	case HDR_AUTHORIZATION:
+	    if (0 != strncasecmp(value.p,"Basic ",6))
+		break;
+	    decode_base64((unsigned char *)req->auth,(unsigned char *)(value.p+6),sizeof(req->auth)-1);
 	    if (debug)
 		fprintf(stderr,"%03d: auth: %s\n",req->fd,req->auth);
-	    
-	} else if (0 == strncasecmp(h,"Range: bytes=",13)) {
+	    break;
+	case HDR_ACCEPT_ENCODING:
+	    req->accept_enc = parse_accept_encoding(value.p);
+	    break;
+	case HDR_ACCEPT:
+	    req->ls_format = parse_accept(value.p);
+	    break;
+	case HDR_RANGE:
 	    /* parsing must be done after fstat, we need the file size
 	       for the boundary checks */
-	    req->range_hdr = h+13;
+	    if (0 == strncasecmp(value.p,"bytes=",6))
+		req->range_hdr = value.p+6;
+	    break;
 	}
     }
     if (debug) {
@@ -456,6 +893,12 @@ parse_request(struct REQUEST *req)
 	if (req->if_range)
 	    fprintf(stderr,"%03d: if-range: \"%s\"\n",
 		    req->fd, req->if_range);
+	if (req->if_match)
+	    fprintf(stderr,"%03d: if-match: %s\n",
+		    req->fd, req->if_match);
+	if (req->if_none_match)
+	    fprintf(stderr,"%03d: if-none-match: %s\n",
+		    req->fd, req->if_none_match);
     }
 
     /* take care about the hostname */
@@ -523,9 +966,8 @@ parse_request(struct REQUEST *req)
 	if (indexhtml) {
 	    /* check for index file */
 	    strncpy(h+1, indexhtml, sizeof(filename) -len -1);
-	    if (-1 != (req->bfd = open(filename,O_RDONLY))) {
+	    if (0 == open_body(req,filename)) {
 		/* ok, we have one */
-	    	close_on_exec(req->bfd);
 		goto regular_file;
 	    } else {
 		if (errno == ENOENT) {
@@ -551,28 +993,18 @@ parse_request(struct REQUEST *req)
 	    }
 	    return;
 	}
-	strftime(req->mtime, sizeof(req->mtime), RFC1123, gmtime(&req->bst.st_mtime));
-	req->mime = "text/html";
+	http_date(req->mtime, req->bst.st_mtime);
+	if (-1 != (rc = query_format(req->query)))
+	    req->ls_format = rc;
 	req->dir = get_dir(req,filename);
-	if (NULL == req->body) {
-	    /* We arrive here if opendir failed, probably due to -EPERM
-	     * It does exist (see the stat() call above) */
-	    mkerror(req,403,1);
-	    return;
-	} else if (NULL != req->if_modified &&
-		   0 == strcmp(req->if_modified, req->mtime)) {
-	    /* 304 not modified */
-	    mkheader(req,304);
-	    req->head_only = 1;
-	} else {
-	    /* 200 OK */
-	    mkheader(req,200);
-	}
+	if (STATE_LS_SCAN != req->state)
+	    dir_request(req);
+	/* else parked, comes back via ls_scan_done() */
 	return;
     }
 
     /* it is /probably/ a regular file */
-    if (-1 == (req->bfd = open(filename,O_RDONLY))) {
+    if (-1 == open_body(req,filename)) {
 	if (errno == EACCES) {
 	    mkerror(req,403,1);
 	} else {
@@ -582,17 +1014,9 @@ parse_request(struct REQUEST *req)
     }
 
  regular_file:
-    fstat(req->bfd,&(req->bst));
-    if (req->range_hdr)
-	if (0 != (rc = parse_ranges(req))) {
-	    mkerror(req,rc,1);
-	    return;
-	}
-
     if (!S_ISREG(req->bst.st_mode)) {
 	/* /not/ a regular file */
-	close(req->bfd);
-	req->bfd = -1;
+	fcache_close(req);
 	if (S_ISDIR(req->bst.st_mode)) {
 	    /* oops: a directory without trailing slash */
 	    strcat(req->path,"/");
@@ -605,15 +1029,41 @@ parse_request(struct REQUEST *req)
     }
 
     /* it is /really/ a regular file */
-    req->mime = get_mime(filename);
-    strftime(req->mtime, sizeof(req->mtime), RFC1123, gmtime(&req->bst.st_mtime));
-    if (NULL != req->if_range  &&  0 != strcmp(req->if_range, req->mtime))
-	/* mtime mismatch -> no ranges */
+    if (req->fc) {
+	req->mime = req->fc->mime;
+	memcpy(req->mtime, req->fc->mtime, sizeof(req->mtime));
+    } else {
+	req->mime = get_mime(filename);
+	http_date(req->mtime, req->bst.st_mtime);
+    }
+    mtime = req->bst.st_mtime;
+    if (req->accept_enc)
+	find_encoded(req,filename);
+    if (NULL == req->encoding && NULL == req->range_hdr)
+	/* compressed on the fly, if enabled.  Called without
+	   Accept-Encoding too, it decides about Vary */
+	fcache_encode(req);
+    if (req->range_hdr)
+	/* against the encoded file, if any */
+	if (0 != (rc = parse_ranges(req))) {
+	    mkerror(req,rc,1);
+	    return;
+	}
+    /* weak if compressed on the fly (body set already) */
+    mketag(req->etag, &req->bst, req->encoding,
+	   NULL != req->encoding && NULL != req->body);
+    if (NULL != req->if_range && !if_range_ok(req, mtime))
+	/* changed -> whole file */
 	req->ranges = 0;
-    if (NULL != req->if_unmodified && 0 != strcmp(req->if_unmodified, req->mtime)) {
+    if (req->fc && req->fc->data && 0 == req->ranges && NULL == req->body) {
+	/* small file, straight from memory */
+	req->body  = req->fc->data;
+	req->lbody = req->bst.st_size;
+    }
+    if (412 == (rc = preconditions(req, mtime))) {
 	/* 412 precondition failed */
 	mkerror(req,412,1);
-    } else if (NULL != req->if_modified && 0 == strcmp(req->if_modified, req->mtime)) {
+    } else if (304 == rc) {
 	/* 304 not modified */
 	mkheader(req,304);
 	req->head_only = 1;
@@ -11,6 +11,7 @@
 
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -83,19 +84,14 @@ static ssize_t xsendfile(int out, int in, off_t offset, off_t off_bytes)
     ssize_t nsent, nsent_total;
     size_t bytes = off_to_size(off_bytes);
 
-    if (lseek(in, offset, SEEK_SET) == -1) {
-	if (debug)
-	    perror("lseek");
-	return -1;
-    }
-
+    /* pread: the file handle may be shared with other threads */
     nsent = nsent_total = 0;
     for (;bytes > 0;) {
 	/* read a block */
-	nread = read(in, buf, (bytes < BUFSIZE) ? bytes : BUFSIZE);
+	nread = pread(in, buf, (bytes < BUFSIZE) ? bytes : BUFSIZE, offset);
 	if (-1 == nread) {
 	    if (debug)
-		perror("read");
+		perror("pread");
 	    return nsent_total ? nsent_total : -1;
 	}
 	if (0 == nread)
@@ -113,6 +109,7 @@ static ssize_t xsendfile(int out, int in, off_t offset, off_t off_bytes)
 	    break;
 
 	bytes -= nread;
+	offset += nread;
     }
     return nsent_total;
 }
@@ -142,8 +139,17 @@ static inline int wrap_write(struct REQUEST *req, void *buf, off_t bytes)
 #else
 # define wrap_xsendfile(req,off,bytes)  xsendfile(req->fd,req->bfd,off,bytes)
 # define wrap_write(req,buf,bytes)      write(req->fd,buf,bytes);
+# define with_ssl                       0
 #endif
 
+/* file contents, from the memory cache if we have it there */
+static inline int send_body(struct REQUEST *req, off_t off, off_t bytes)
+{
+    if (req->fc && req->fc->data)
+	return wrap_write(req, req->fc->data + off, bytes);
+    return wrap_xsendfile(req, off, bytes);
+}
+
 /* ---------------------------------------------------------------------- */
 
 static struct HTTP_STATUS {
@@ -210,9 +216,7 @@ mkerror(struct REQUEST *req, int status, int ka)
 	req->lres += sprintf(req->hres+req->lres,
 			     "WWW-Authenticate: Basic realm=\"webfs\"\r\n");
     mkcors(req);
-    req->lres += strftime(req->hres+req->lres,80,
-			  "Date: " RFC1123 "\r\n\r\n",
-			  gmtime(&now));
+    req->lres += sprintf(req->hres+req->lres,"Date: %s\r\n\r\n",http_now());
     req->state = STATE_WRITE_HEADER;
     if (debug)
 	fprintf(stderr,"%03d: error: %d, connection=%s\n",
@@ -235,9 +239,7 @@ mkredirect(struct REQUEST *req)
 			req->hostname,tcp_port,quote((unsigned char *)req->path,9999),
 			(int64_t)req->lbody);
     mkcors(req);
-    req->lres += strftime(req->hres+req->lres,80,
-			  "Date: " RFC1123 "\r\n\r\n",
-			  gmtime(&now));
+    req->lres += sprintf(req->hres+req->lres,"Date: %s\r\n\r\n",http_now());
     req->state = STATE_WRITE_HEADER;
     if (debug)
 	fprintf(stderr,"%03d: 302 redirect: %s, connection=%s\n",
@@ -266,12 +268,23 @@ mkmulti(struct REQUEST *req, int i)
     return req->r_hlen[i];
 }
 
+/* "inode-size-mtime" in hex, plus the content coding if any */
+int
+mketag(char *buf, struct stat *st, char *encoding, int weak)
+{
+    return sprintf(buf, "%s\"%" PRIx64 "-%" PRIx64 "-%" PRIx64 "%s%s\"",
+		   weak ? "W/" : "",
+		   (uint64_t)st->st_ino, (uint64_t)st->st_size,
+		   (uint64_t)st->st_mtime,
+		   encoding ? "-" : "", encoding ? encoding : "");
+}
+
 void
 mkheader(struct REQUEST *req, int status)
 {
-    int    i;
+    int    i, cached;
     off_t  len;
-    time_t expires;
+    char   date[DATE_LEN+1];
 
     for (i = 0; http[i].status != 0; i++)
 	if (http[i].status == status)
@@ -281,7 +294,18 @@ mkheader(struct REQUEST *req, int status)
 			RESPONSE_START,
 			http[i].head,server_name,
 			req->keep_alive ? "Keep-Alive" : "Close");
-    if (req->ranges == 0) {
+    cached = (req->ranges == 0 && req->fc && req->fc->lhead && !req->encoding);
+    if (cached) {
+	/* preformatted by the file cache */
+	memcpy(req->hres+req->lres, req->fc->head, req->fc->lhead);
+	req->lres += req->fc->lhead;
+    } else if (req->ls) {
+	/* length unknown until it is rendered */
+	req->lres += sprintf(req->hres+req->lres,
+			     "Content-Type: %s\r\n%s",
+			     req->mime,
+			     req->ls->chunked ? "Transfer-Encoding: chunked\r\n" : "");
+    } else if (req->ranges == 0) {
 	req->lres += sprintf(req->hres+req->lres,
 			     "Content-Type: %s\r\n"
 			     "Content-Length: %" PRId64 "\r\n",
@@ -312,21 +336,30 @@ mkheader(struct REQUEST *req, int status)
 			     "Content-Length: %" PRId64 "\r\n",
 			     now, (int64_t)len);
     }
-    if (req->mtime[0] != '\0') {
+    if (req->encoding)
+	req->lres += sprintf(req->hres+req->lres,
+			     "Content-Encoding: %s\r\n",
+			     req->encoding);
+    if (req->encoding || req->vary)
+	/* identity responses too, caches must not hand them to
+	   clients which would get a compressed copy */
+	req->lres += sprintf(req->hres+req->lres,"Vary: Accept-Encoding\r\n");
+    if (req->dir)
+	/* listings come as html or json */
+	req->lres += sprintf(req->hres+req->lres,"Vary: Accept\r\n");
+    if (!cached && req->etag[0] != '\0')
+	req->lres += sprintf(req->hres+req->lres,"ETag: %s\r\n",req->etag);
+    if (!cached && req->mtime[0] != '\0') {
 	req->lres += sprintf(req->hres+req->lres,
 			     "Last-Modified: %s\r\n",
 			     req->mtime);
 	if (-1 != lifespan) {
-	    expires = req->bst.st_mtime + lifespan;
-	    req->lres += strftime(req->hres+req->lres,80,
-				  "Expires: " RFC1123 "\r\n",
-				  gmtime(&expires));
+	    http_date(date,req->bst.st_mtime + lifespan);
+	    req->lres += sprintf(req->hres+req->lres,"Expires: %s\r\n",date);
 	}
     }
     mkcors(req);
-    req->lres += strftime(req->hres+req->lres,80,
-			  "Date: " RFC1123 "\r\n\r\n",
-			  gmtime(&now));
+    req->lres += sprintf(req->hres+req->lres,"Date: %s\r\n\r\n",http_now());
     req->state = STATE_WRITE_HEADER;
     if (debug)
 	fprintf(stderr,"%03d: %d, connection=%s\n",
@@ -343,10 +376,8 @@ mkcgi(struct REQUEST *req, char *status, struct strlist *header)
 			status, server_name,"Close");
     for (; NULL != header; header = header->next)
 	req->lres += sprintf(req->hres+req->lres,"%s\r\n",header->line);
-    req->lres += strftime(req->hres+req->lres,80,
-			  "Date: " RFC1123 "\r\n\r\n",
-			  gmtime(&now));
     mkcors(req);
+    req->lres += sprintf(req->hres+req->lres,"Date: %s\r\n\r\n",http_now());
     req->state = STATE_WRITE_HEADER;
 }
 
@@ -354,11 +385,43 @@ mkcgi(struct REQUEST *req, char *status, struct strlist *header)
 
 void write_request(struct REQUEST *req)
 {
+    struct iovec iov[2];
     int rc;
 
     for (;;) {
 	switch (req->state) {
 	case STATE_WRITE_HEADER:
+	    if (req->body && !req->head_only && !with_ssl) {
+		/* header and body in one go, no need to cork */
+		iov[0].iov_base = req->hres + req->written;
+		iov[0].iov_len  = req->lres - req->written;
+		iov[1].iov_base = req->body;
+		iov[1].iov_len  = req->lbody;
+		/* the event engine may have sent the same already */
+		rc = req->ev_done ? ev_result(req) : writev(req->fd, iov, 2);
+		switch (rc) {
+		case -1:
+		    if (errno == EAGAIN)
+			return;
+		    if (errno == EINTR)
+			continue;
+		    xperror(LOG_INFO,"writev",req_peerhost(req));
+		    /* fall through */
+		case 0:
+		    req->state = STATE_CLOSE;
+		    return;
+		default:
+		    req->bc += rc;
+		    if (rc < (int)iov[0].iov_len) {
+			req->written += rc;
+			return;
+		    }
+		}
+		req->written = rc - iov[0].iov_len;
+		req->state = (req->written == req->lbody) ?
+		    STATE_FINISHED : STATE_WRITE_BODY;
+		return;
+	    }
 #ifdef TCP_CORK
 	    if (0 == req->tcp_cork && !req->head_only) {
 		req->tcp_cork = 1;
@@ -375,7 +438,7 @@ void write_request(struct REQUEST *req)
 		    return;
 		if (errno == EINTR)
 		    continue;
-		xperror(LOG_INFO,"write",req->peerhost);
+		xperror(LOG_INFO,"write",req_peerhost(req));
 		/* fall through */
 	    case 0:
 		req->state = STATE_CLOSE;
@@ -393,8 +456,12 @@ void write_request(struct REQUEST *req)
 	    } else if (req->cgipid) {
 		req->state = (req->cgipos != req->cgilen) ?
 		    STATE_CGI_BODY_OUT : STATE_CGI_BODY_IN;
+	    } else if (req->ls) {
+		req->state = STATE_WRITE_LISTING;
+		req->ls->out.len = 0;
 	    } else if (req->body) {
-		req->state = STATE_WRITE_BODY;
+		/* empty listings are cached as empty bodies */
+		req->state = req->lbody ? STATE_WRITE_BODY : STATE_FINISHED;
 	    } else if (req->ranges == 1) {
 		req->state = STATE_WRITE_RANGES;
 		req->rh = -1;
@@ -409,15 +476,18 @@ void write_request(struct REQUEST *req)
 	    }
 	    break;
 	case STATE_WRITE_BODY:
-	    rc = wrap_write(req,req->body + req->written,
-			    req->lbody - req->written);
+	    if (req->ev_done)
+		rc = ev_result(req);
+	    else
+		rc = wrap_write(req,req->body + req->written,
+				req->lbody - req->written);
 	    switch (rc) {
 	    case -1:
 		if (errno == EAGAIN)
 		    return;
 		if (errno == EINTR)
 		    continue;
-		xperror(LOG_INFO,"write",req->peerhost);
+		xperror(LOG_INFO,"write",req_peerhost(req));
 		/* fall through */
 	    case 0:
 		req->state = STATE_CLOSE;
@@ -431,7 +501,7 @@ void write_request(struct REQUEST *req)
 	    req->state = STATE_FINISHED;
 	    return;
 	case STATE_WRITE_FILE:
-	    rc = wrap_xsendfile(req, req->written,
+	    rc = send_body(req, req->written,
 				req->bst.st_size - req->written);
 	    switch (rc) {
 	    case -1:
@@ -439,7 +509,7 @@ void write_request(struct REQUEST *req)
 		    return;
 		if (errno == EINTR)
 		    continue;
-		xperror(LOG_INFO,"sendfile",req->peerhost);
+		xperror(LOG_INFO,"sendfile",req_peerhost(req));
 		/* fall through */
 	    case 0:
 		req->state = STATE_CLOSE;
@@ -468,7 +538,7 @@ void write_request(struct REQUEST *req)
 			return;
 		    if (errno == EINTR)
 			continue;
-		    xperror(LOG_INFO,"write",req->peerhost);
+		    xperror(LOG_INFO,"write",req_peerhost(req));
 		    /* fall through */
 		case 0:
 		    req->state = STATE_CLOSE;
@@ -491,7 +561,7 @@ void write_request(struct REQUEST *req)
 	    }
 	    if (-1 != req->rb) {
 		/* write body */
-		rc = wrap_xsendfile(req, req->written,
+		rc = send_body(req, req->written,
 				    req->r_end[req->rb] - req->written);
 		switch (rc) {
 		case -1:
@@ -499,7 +569,7 @@ void write_request(struct REQUEST *req)
 			return;
 		    if (errno == EINTR)
 			continue;
-		    xperror(LOG_INFO,"sendfile",req->peerhost);
+		    xperror(LOG_INFO,"sendfile",req_peerhost(req));
 		    /* fall through */
 		case 0:
 		    req->state = STATE_CLOSE;
@@ -521,6 +591,33 @@ void write_request(struct REQUEST *req)
 		}
 	    }
 	    break;
+	case STATE_WRITE_LISTING:
+	    if (req->ls->written == req->ls->out.len) {
+		/* render the next chunk */
+		rc = ls_fill(req);
+		if (rc <= 0) {
+		    req->state = (0 == rc) ? STATE_FINISHED : STATE_CLOSE;
+		    return;
+		}
+	    }
+	    rc = wrap_write(req,req->ls->out.buf + req->ls->written,
+			    req->ls->out.len - req->ls->written);
+	    switch (rc) {
+	    case -1:
+		if (errno == EAGAIN)
+		    return;
+		if (errno == EINTR)
+		    continue;
+		xperror(LOG_INFO,"write",req_peerhost(req));
+		/* fall through */
+	    case 0:
+		req->state = STATE_CLOSE;
+		return;
+	    default:
+		req->ls->written += rc;
+		req->bc += rc;
+	    }
+	    break;
 	case STATE_CGI_BODY_IN:
 	    rc = read(req->cgipipe, req->cgibuf, MAX_HEADER);
 	    switch (rc) {
@@ -529,7 +626,7 @@ void write_request(struct REQUEST *req)
 		    return;
 		if (errno == EINTR)
 		    continue;
-		xperror(LOG_INFO,"cgi read",req->peerhost);
+		xperror(LOG_INFO,"cgi read",req_peerhost(req));
 		/* fall through */
 	    case 0:
 		req->state = STATE_FINISHED;
@@ -552,7 +649,7 @@ void write_request(struct REQUEST *req)
 		    return;
 		if (errno == EINTR)
 		    continue;
-		xperror(LOG_INFO,"write",req->peerhost);
+		xperror(LOG_INFO,"write",req_peerhost(req));
 		/* fall through */
 	    case 0:
 		req->state = STATE_CLOSE;
@@ -3,15 +3,55 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
 #include <sys/socket.h>
 
 #include <openssl/err.h>
 #include <openssl/evp.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+# include <openssl/core_names.h>
+#endif
 
 #include "httpd.h"
 
+#define SSL_BLK  65536                  /* userspace file copy, no kTLS */
+
+#define SESSION_CACHE   20480           /* sessions kept for resumption */
+#define SESSION_TIMEOUT 3600            /* seconds */
+#define TICKET_ROTATE   3600            /* new ticket key every hour */
+#define HANDSHAKE_QUEUE 1024            /* more waiting: do it inline */
+
+static THREAD_LOCAL char *blk_buf;
+
 #ifdef USE_THREADS
-static pthread_mutex_t lock_ssl = PTHREAD_MUTEX_INITIALIZER;
+/* handshake threads: the event loops queue connections which are
+   ready for the next handshake step, the threads hand them back via
+   a per-loop lock-free list and a wakeup */
+static pthread_mutex_t lock_handshake = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  handshake_cond = PTHREAD_COND_INITIALIZER;
+static struct REQUEST  *hs_head, *hs_tail;
+static int             hs_queued;
+static unsigned long   hs_offloaded, hs_inline;
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+/* session ticket keys: tickets are issued with the current key and
+   accepted (and renewed) with the previous one for another period */
+struct TICKET_KEY {
+    unsigned char name[16];
+    unsigned char aes[32];
+    unsigned char hmac[32];
+};
+
+# ifdef USE_THREADS
+static pthread_mutex_t lock_tickets = PTHREAD_MUTEX_INITIALIZER;
+# endif
+static struct TICKET_KEY ticket_keys[2];    /* current, previous */
+static time_t            ticket_born;
+static int               ticket_prev;       /* [1] is valid */
 #endif
 
 int ssl_read(struct REQUEST *req, char *buf, int len)
@@ -64,25 +104,53 @@ int ssl_write(struct REQUEST *req, char *buf, int len)
     return rc;
 }
 
+/* kernel does the encryption, we can sendfile() */
+static int ssl_ktls(struct REQUEST *req)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    return BIO_get_ktls_send(SSL_get_wbio(req->ssl_s));
+#else
+    return 0;
+#endif
+}
+
 int ssl_blk_write(struct REQUEST *req, off_t offset, size_t len)
 {
     int  rc;
-    char buf[4096];
 
-    if (lseek(req->bfd, offset, SEEK_SET) == -1) {
-        if (debug) perror("lseek");
-        return -1;
+#ifdef SSL_OP_ENABLE_KTLS
+    if (ssl_ktls(req)) {
+	ERR_clear_error();
+	rc = SSL_sendfile(req->ssl_s, req->bfd, offset, len, 0);
+	if (rc < 0 && SSL_get_error(req->ssl_s, rc) == SSL_ERROR_WANT_WRITE) {
+	    errno = EAGAIN;
+	    return -1;
+	}
+	if (rc < 0) {
+	    if (debug)
+		fprintf(stderr, "%03d: SSL_sendfile error: %s\n", req->fd,
+			ERR_error_string(ERR_get_error(), NULL));
+	    errno = EIO;
+	    return -1;
+	}
+	return rc;
     }
+#endif
 
-    if (len > sizeof(buf))
-	len = sizeof(buf);
-    rc = read(req->bfd, buf, len);
+    if (NULL == blk_buf && NULL == (blk_buf = malloc(SSL_BLK))) {
+	errno = ENOMEM;
+	return -1;
+    }
+    if (len > SSL_BLK)
+	len = SSL_BLK;
+    /* pread: the file handle may be shared with other threads */
+    rc = pread(req->bfd, blk_buf, len, offset);
     if (rc <= 0) {
 	/* shouldn't happen ... */
 	req->state = STATE_CLOSE;
 	return rc;
     }
-    return ssl_write(req, buf, rc);
+    return ssl_write(req, blk_buf, rc);
 }
 
 static int password_cb(char *buf, int num, int rwflag, void *userdata)
@@ -96,6 +164,100 @@ static int password_cb(char *buf, int num, int rwflag, void *userdata)
     return(strlen(buf));
 }
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int ticket_rotate(void)
+{
+    time_t t = time(NULL);
+
+    if (ticket_born && t - ticket_born < TICKET_ROTATE)
+	return 0;
+    if (ticket_born) {
+	ticket_keys[1] = ticket_keys[0];
+	ticket_prev = 1;
+    }
+    if (1 != RAND_bytes((unsigned char*)&ticket_keys[0],
+			sizeof(ticket_keys[0])))
+	return -1;
+    ticket_born = t;
+    if (debug)
+	fprintf(stderr,"ssl: new session ticket key\n");
+    return 0;
+}
+
+static int ticket_cb(SSL *s, unsigned char key_name[16],
+		     unsigned char iv[EVP_MAX_IV_LENGTH],
+		     EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc)
+{
+    OSSL_PARAM params[3];
+    struct TICKET_KEY key;
+    int rc = 1;
+
+    DO_LOCK(lock_tickets);
+    if (-1 == ticket_rotate()) {
+	DO_UNLOCK(lock_tickets);
+	return -1;
+    }
+    if (enc) {
+	key = ticket_keys[0];
+    } else if (0 == memcmp(key_name,ticket_keys[0].name,16)) {
+	key = ticket_keys[0];
+    } else if (ticket_prev && 0 == memcmp(key_name,ticket_keys[1].name,16)) {
+	/* still good, but issue a new one */
+	key = ticket_keys[1];
+	rc = 2;
+    } else {
+	/* unknown or expired: full handshake */
+	DO_UNLOCK(lock_tickets);
+	return 0;
+    }
+    DO_UNLOCK(lock_tickets);
+
+    if (enc) {
+	memcpy(key_name,key.name,16);
+	if (1 != RAND_bytes(iv,16))
+	    return -1;
+	if (1 != EVP_EncryptInit_ex(cctx,EVP_aes_256_cbc(),NULL,key.aes,iv))
+	    return -1;
+    } else {
+	if (1 != EVP_DecryptInit_ex(cctx,EVP_aes_256_cbc(),NULL,key.aes,iv))
+	    return -1;
+    }
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+						  key.hmac,sizeof(key.hmac));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+						 "sha256",0);
+    params[2] = OSSL_PARAM_construct_end();
+    if (1 != EVP_MAC_CTX_set_params(hctx,params))
+	return -1;
+    OPENSSL_cleanse(&key,sizeof(key));
+    return rc;
+}
+#endif
+
+/* handshakes, for SIGUSR1 */
+void ssl_stats(void)
+{
+    char msg[256];
+
+#ifdef USE_THREADS
+    if (ssl_threads) {
+	DO_LOCK(lock_handshake);
+	snprintf(msg,sizeof(msg),"ssl: %d handshake threads, %lu steps "
+		 "offloaded, %lu inline (queue full), %d queued",
+		 ssl_threads, hs_offloaded, hs_inline, hs_queued);
+	DO_UNLOCK(lock_handshake);
+	xerror(LOG_NOTICE,msg,NULL);
+    }
+#endif
+
+    snprintf(msg,sizeof(msg),"ssl: %ld handshakes, %ld resumed, "
+	     "%ld cache misses, %ld timeouts, %ld sessions cached",
+	     SSL_CTX_sess_accept_good(ctx), SSL_CTX_sess_hits(ctx),
+	     SSL_CTX_sess_misses(ctx), SSL_CTX_sess_timeouts(ctx),
+	     SSL_CTX_sess_number(ctx));
+    xerror(LOG_NOTICE,msg,NULL);
+}
+
 void init_ssl(void)
 {
     int rc;
@@ -135,11 +297,31 @@ void init_ssl(void)
     }
 
     SSL_CTX_set_options(ctx, SSL_OP_ALL | SSL_OP_NO_SSLv2);
+#ifdef SSL_OP_ENABLE_KTLS
+    /* let the kernel do the record layer if it can (tls module) */
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    /* big file chunks go out in several records, report progress per
+       record; retries come from a buffer which may have moved */
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+		     SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    /* resumption: session ids (shared by all threads) and tickets,
+       TLS 1.3 uses the tickets */
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, SESSION_CACHE);
+    SSL_CTX_set_timeout(ctx, SESSION_TIMEOUT);
+    SSL_CTX_set_session_id_context(ctx, (unsigned char*)"webfsd", 6);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    if (-1 == ticket_rotate() ||
+	1 != SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_cb))
+	fprintf(stderr, "SSL ticket key setup failed, using defaults\n");
+#endif
 }
 
 void open_ssl_session(struct REQUEST *req)
 {
-    DO_LOCK(lock_ssl);
+    /* SSL_new() and the session cache do their own locking */
     req->ssl_s = SSL_new(ctx);
     if (req->ssl_s == NULL) {
 	if (debug)
@@ -150,5 +332,142 @@ void open_ssl_session(struct REQUEST *req)
     SSL_set_fd(req->ssl_s, req->fd);
     SSL_set_accept_state(req->ssl_s);
     SSL_set_read_ahead(req->ssl_s, 0); /* to prevent unwanted buffering in ssl layer */
-    DO_UNLOCK(lock_ssl);
+}
+
+void close_ssl_session(struct REQUEST *req)
+{
+    /* send close_notify (best effort, we don't wait for the peer's),
+       OpenSSL drops sessions of connections which just vanish from
+       the cache */
+    if (SSL_is_init_finished(req->ssl_s)) {
+	SSL_set_quiet_shutdown(req->ssl_s, 0);
+	SSL_shutdown(req->ssl_s);
+    }
+    SSL_free(req->ssl_s);
+    req->ssl_s = NULL;
+}
+
+/* one handshake step, returns the event to wait for, 0 when done
+   and -1 on failure.  Touches nothing but req->ssl_s, so it may run
+   on any thread which owns the request for the moment. */
+int ssl_handshake(struct REQUEST *req)
+{
+    unsigned long err;
+    int rc;
+
+    ERR_clear_error();
+    rc = SSL_do_handshake(req->ssl_s);
+    if (1 == rc) {
+	if (debug)
+	    fprintf(stderr,"%03d: ssl handshake done (%s%s)\n", req->fd,
+		    SSL_get_version(req->ssl_s),
+		    SSL_session_reused(req->ssl_s) ? ", resumed" : "");
+	return 0;
+    }
+    switch (SSL_get_error(req->ssl_s, rc)) {
+    case SSL_ERROR_WANT_READ:
+	return EV_READ;
+    case SSL_ERROR_WANT_WRITE:
+	return EV_WRITE;
+    }
+    if (debug)
+	while (0 != (err = ERR_get_error()))
+	    fprintf(stderr, "%03d: ssl handshake error: %s\n", req->fd,
+		    ERR_error_string(err, NULL));
+    return -1;
+}
+
+#ifdef USE_THREADS
+static void* handshake_thread(void *arg)
+{
+    struct REQUEST *req,*prev;
+    struct EVLOOP *loop;
+
+    for (;;) {
+	DO_LOCK(lock_handshake);
+	while (NULL == hs_head)
+	    pthread_cond_wait(&handshake_cond,&lock_handshake);
+	req = hs_head;
+	hs_head = req->ssl_next;
+	if (NULL == hs_head)
+	    hs_tail = NULL;
+	hs_queued--;
+	DO_UNLOCK(lock_handshake);
+
+	req->ssl_want = ssl_handshake(req);
+
+	/* push to the loop's list, the loop owns req again as soon as
+	   the exchange succeeds.  Only the push onto an empty list has
+	   to wake it up, later ones find a wakeup pending. */
+	loop = req->ssl_loop;
+	prev = __atomic_load_n(&loop->tls_done,__ATOMIC_RELAXED);
+	do {
+	    req->ssl_next = prev;
+	} while (!__atomic_compare_exchange_n(&loop->tls_done,&prev,req,1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+	if (NULL == prev)
+	    ev_wake(loop);
+    }
+    return NULL;
+}
+#endif
+
+/* start the handshake threads, call this after fork() */
+void ssl_start(void)
+{
+#ifdef USE_THREADS
+    pthread_t thread;
+    int i;
+
+    for (i = 0; i < ssl_threads; i++) {
+	if (0 != pthread_create(&thread,NULL,handshake_thread,NULL)) {
+	    xperror(LOG_WARNING,"start handshake thread",NULL);
+	    break;
+	}
+	pthread_detach(thread);
+    }
+    ssl_threads = i;
+    if (debug && ssl_threads)
+	fprintf(stderr,"ssl: %d handshake threads\n",ssl_threads);
+#else
+    ssl_threads = 0;
+#endif
+}
+
+/* queue the next handshake step, -1: do it yourself */
+int ssl_offload(struct EVLOOP *loop, struct REQUEST *req)
+{
+#ifdef USE_THREADS
+    if (0 == ssl_threads || -1 == loop->wakefd[1])
+	return -1;
+    DO_LOCK(lock_handshake);
+    if (hs_queued >= HANDSHAKE_QUEUE) {
+	hs_inline++;
+	DO_UNLOCK(lock_handshake);
+	return -1;
+    }
+    req->ssl_loop = loop;
+    req->ssl_next = NULL;
+    if (hs_tail)
+	hs_tail->ssl_next = req;
+    else
+	hs_head = req;
+    hs_tail = req;
+    hs_queued++;
+    hs_offloaded++;
+    pthread_cond_signal(&handshake_cond);
+    DO_UNLOCK(lock_handshake);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* take the requests the handshake threads handed back (ssl_want set) */
+struct REQUEST* ssl_offload_done(struct EVLOOP *loop)
+{
+    if (NULL == __atomic_load_n(&loop->tls_done,__ATOMIC_RELAXED))
+	return NULL;
+    return __atomic_exchange_n(&loop->tls_done,NULL,__ATOMIC_ACQUIRE);
 }
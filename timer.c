@@ -0,0 +1,166 @@
+/*
+ * timer wheel for network and keepalive timeouts
+ *
+ * Two levels: 256 one-second slots, 64 slots covering 256 seconds each.
+ * Requests are re-armed in O(1) and expiring costs O(expired), no matter
+ * how many idle connections are around.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "httpd.h"
+
+/* ---------------------------------------------------------------------- */
+
+static void
+timer_link(struct TIMERS *t, struct REQUEST *req)
+{
+    struct REQUEST **slot;
+    time_t expires = req->expires;
+
+    if (expires < t->tick)
+	/* overdue -- expire with the next tick */
+	expires = t->tick;
+    if (expires - t->tick < WHEEL_SIZE)
+	slot = &t->wheel[expires & (WHEEL_SIZE-1)];
+    else if ((expires >> WHEEL_BITS) - (t->tick >> WHEEL_BITS) < WHEEL1_SIZE)
+	slot = &t->wheel1[(expires >> WHEEL_BITS) & (WHEEL1_SIZE-1)];
+    else
+	/* way out: park in the last slot, gets sorted in again later */
+	slot = &t->wheel1[((t->tick >> WHEEL_BITS) + WHEEL1_SIZE-1)
+			  & (WHEEL1_SIZE-1)];
+
+    req->t_slot = slot;
+    req->t_prev = NULL;
+    req->t_next = *slot;
+    if (*slot)
+	(*slot)->t_prev = req;
+    *slot = req;
+}
+
+static void
+timer_unlink(struct REQUEST *req)
+{
+    if (req->t_prev)
+	req->t_prev->t_next = req->t_next;
+    else
+	*req->t_slot = req->t_next;
+    if (req->t_next)
+	req->t_next->t_prev = req->t_prev;
+    req->t_slot = NULL;
+    req->t_prev = NULL;
+    req->t_next = NULL;
+}
+
+/* ---------------------------------------------------------------------- */
+
+void
+timer_init(struct TIMERS *t, time_t now)
+{
+    memset(t,0,sizeof(*t));
+    t->tick = now;
+}
+
+/* (re-)arm: the request times out once the clock reaches expires */
+void
+timer_set(struct TIMERS *t, struct REQUEST *req, time_t expires)
+{
+    if (req->t_slot) {
+	if (req->expires == expires)
+	    return;
+	timer_unlink(req);
+    } else {
+	t->count++;
+    }
+    req->expires = expires;
+    timer_link(t,req);
+}
+
+void
+timer_del(struct TIMERS *t, struct REQUEST *req)
+{
+    if (NULL == req->t_slot)
+	return;
+    timer_unlink(req);
+    t->count--;
+}
+
+/* unlink all requests due at now, returns them chained via t_next */
+struct REQUEST*
+timer_expire(struct TIMERS *t, time_t now)
+{
+    struct REQUEST *list = NULL, *req, *next, *cascade;
+
+    if (0 == t->count) {
+	t->tick = now+1;
+	return NULL;
+    }
+    if (now - t->tick > WHEEL_SIZE * WHEEL1_SIZE)
+	/* clock jump, slots skipped here are caught on the next round */
+	t->tick = now - WHEEL_SIZE * WHEEL1_SIZE;
+
+    for (; t->tick <= now; t->tick++) {
+	if (0 == (t->tick & (WHEEL_SIZE-1))) {
+	    /* next 256 seconds -- move them down to the first level */
+	    cascade = t->wheel1[(t->tick >> WHEEL_BITS) & (WHEEL1_SIZE-1)];
+	    t->wheel1[(t->tick >> WHEEL_BITS) & (WHEEL1_SIZE-1)] = NULL;
+	    for (req = cascade; req != NULL; req = next) {
+		next = req->t_next;
+		timer_link(t,req);
+	    }
+	}
+	for (req = t->wheel[t->tick & (WHEEL_SIZE-1)]; req != NULL; req = next) {
+	    next = req->t_next;
+	    if (req->expires > now)
+		continue;
+	    timer_unlink(req);
+	    t->count--;
+	    req->t_next = list;
+	    list = req;
+	}
+    }
+    return list;
+}
+
+/* milliseconds until the next timer is due, -1 if there is none */
+int
+timer_wait(struct TIMERS *t)
+{
+    struct timeval tv;
+    time_t next = 0;
+    long ms;
+    int i;
+
+    if (0 == t->count)
+	return -1;
+    for (i = 0; i < WHEEL_SIZE; i++) {
+	if (t->wheel[(t->tick + i) & (WHEEL_SIZE-1)]) {
+	    next = t->tick + i;
+	    break;
+	}
+    }
+    if (0 == next) {
+	/* nothing on the first level, wake up for the next cascade */
+	next = ((t->tick >> WHEEL_BITS) + 1) << WHEEL_BITS;
+	for (i = 1; i < WHEEL1_SIZE; i++) {
+	    if (t->wheel1[((t->tick >> WHEEL_BITS) + i) & (WHEEL1_SIZE-1)]) {
+		next = ((t->tick >> WHEEL_BITS) + i) << WHEEL_BITS;
+		break;
+	    }
+	}
+    }
+
+    gettimeofday(&tv,NULL);
+    ms = (next - tv.tv_sec) * 1000 - tv.tv_usec / 1000;
+    if (ms < 0)
+	return 0;
+    if (ms > WHEEL_SIZE * WHEEL1_SIZE * 1000L)
+	return WHEEL_SIZE * WHEEL1_SIZE * 1000;
+    return ms;
+}
@@ -12,6 +12,7 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/signal.h>
 #include <sys/utsname.h>
 #include <sys/socket.h>
@@ -20,9 +21,16 @@
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#ifdef __linux__
+# include <sched.h>
+#endif
 
 #include "httpd.h"
 
+#if defined(__linux__) && defined(SO_REUSEPORT)
+# define REUSEPORT_LB 1   /* kernel balances connections between sockets */
+#endif
+
 /* ---------------------------------------------------------------------- */
 /* public variables - server configuration                                */
 
@@ -34,6 +42,11 @@ int     timeout        = 60;
 int     keepalive_time = 5;
 int     tcp_port       = 0;
 int     max_dircache   = 128;
+off_t   dircache_max   = 16 << 20;
+int     fcache_max     = 0;
+int     fcache_valid   = 1;
+off_t   mcache_max     = 0;
+off_t   zcache_max     = 0;
 char    *cors          = NULL;
 char    *doc_root      = ".";
 char    *indexhtml     = NULL;
@@ -48,7 +61,6 @@ char    group[17];
 char    *mimetypes     = MIMEFILE;
 char    *pidfile       = NULL;
 char    *logfile       = NULL;
-FILE    *logfh         = NULL;
 char    *userpass      = NULL;
 char    *userdir       = NULL;
 int     flushlog       = 0;
@@ -58,20 +70,42 @@ int     have_tty       = 1;
 int     max_conn       = 32;
 int     lifespan       = -1;
 int     no_listing     = 0;
+char    *engine        = NULL;
 
-time_t  now;
+THREAD_LOCAL time_t now;
 int     slisten;
 
 #ifdef USE_THREADS
-pthread_mutex_t lock_logfile = PTHREAD_MUTEX_INITIALIZER;
 int       nthreads = 1;
-pthread_t *threads;
+int       pin_threads = 0;
+#endif
+
+struct WORKER {
+    int          id;
+    int          slisten;            /* own socket or shared slisten */
+    int          cpu;                /* -1: not pinned */
+#ifdef USE_THREADS
+    pthread_t    thread;
+#endif
+};
+
+static struct WORKER *workers;
+static int           nworkers = 1;
+static volatile int  conn_total;     /* all threads */
+
+#ifdef USE_THREADS
+# define CONN_ADD(n)	__sync_add_and_fetch(&conn_total,n)
+#else
+# define CONN_ADD(n)	(conn_total += (n))
 #endif
 
+#define ACCEPT_BATCH    64           /* accept()s per wakeup */
+
 #ifdef USE_SSL
 char	*certificate   = "server.pem";
 char	*password;
 int	with_ssl       = 0;
+int	ssl_threads    = -1;           /* auto */
 SSL_CTX *ctx;
 BIO	*sbio, *ssl_bio;
 #endif
@@ -79,6 +113,7 @@ BIO	*sbio, *ssl_bio;
 /* ---------------------------------------------------------------------- */
 
 static int termsig,got_sighup;
+static volatile int got_sigusr1;     /* bumped for each stats request */
 
 static void catchsig(int sig)
 {
@@ -86,6 +121,8 @@ static void catchsig(int sig)
 	termsig = sig;
     if (SIGHUP == sig)
 	got_sighup = 1;
+    if (SIGUSR1 == sig)
+	got_sigusr1++;
 }
 
 /* ---------------------------------------------------------------------- */
@@ -114,9 +151,18 @@ usage(char *name)
 	    "  -c n     set max. allowed connections        [%i]\n"
 	    "  -O CORS  set CORS header                     [%s]\n"
 	    "  -a n     set max. cached dirs                [%i]\n"
+	    "  -D size  memory for cached dirs (k/m/g)      [%ldk]\n"
+	    "  -K n     set max. cached open files          [%i]\n"
+	    "  -T sec   recheck cached files after sec      [%i]\n"
+	    "  -M size  keep small files in memory (k/m/g)  [%ldk]\n"
+#if defined(USE_ZLIB) && defined(USE_THREADS)
+	    "  -Z size  compress on the fly, cache size     [%ldk]\n"
+#endif
 	    "  -j       disable directory listings          [%s]\n"
+	    "  -E name  event engine (select/epoll/uring)   [%s]\n"
 #ifdef USE_THREADS
 	    "  -y n     startup n threads                   [%i]\n"
+	    "  -A       pin threads to cpus                 [%s]\n"
 #endif
 	    "  -p port  use tcp-port >port<                 [%s]\n"
 	    "  -r dir   document root is >dir<              [%s]\n"
@@ -138,6 +184,9 @@ usage(char *name)
 	    "  -S       enable SSL mode\n"
 	    "  -C file  SSL-Certificate file                [%s]\n"
 	    "  -P pass  SSL-Certificate password\n"
+# ifdef USE_THREADS
+	    "  -H n     do TLS handshakes in n threads      [auto]\n"
+# endif
 #endif
 	    "  -x dir   CGI script directory (relative to\n"
 	    "           document root)                      [%s]\n"
@@ -149,10 +198,15 @@ usage(char *name)
 	    usesyslog ?  "on" : "off",
 	    timeout, max_conn,
 	    cors ? cors : "none",
-	    max_dircache,
+	    max_dircache, (long)(dircache_max >> 10), fcache_max, fcache_valid, (long)(mcache_max >> 10),
+#if defined(USE_ZLIB) && defined(USE_THREADS)
+	    (long)(zcache_max >> 10),
+#endif
 	    no_listing ? "on" : "off",
+	    engine ? engine : "auto",
 #ifdef USE_THREADS
 	    nthreads,
+	    pin_threads ? "on" : "off",
 #endif
 	    listen_port, doc_root,
 	    indexhtml ? indexhtml : "none",
@@ -178,6 +232,22 @@ usage(char *name)
     exit(0);
 }
 
+/* "256m" => 268435456 */
+static off_t
+parse_size(char *str)
+{
+    char *end;
+    off_t size;
+
+    size = strtoll(str,&end,10);
+    switch (*end) {
+    case 'g': case 'G': size <<= 10; /* fall through */
+    case 'm': case 'M': size <<= 10; /* fall through */
+    case 'k': case 'K': size <<= 10; break;
+    }
+    return size;
+}
+
 static void run_as(int id)
 {
     if (-1 == seteuid(id)) {
@@ -255,42 +325,6 @@ fix_ug(void)
 
 /* ---------------------------------------------------------------------- */
 
-static void
-access_log(struct REQUEST *req, time_t now)
-{
-    char timestamp[32];
-
-    DO_LOCK(lock_logfile);
-    if (NULL == logfh) {
-	DO_UNLOCK(lock_logfile);
-	return;
-    }
-
-    /* common log format: host ident authuser date request status bytes */
-    strftime(timestamp,31,"[%d/%b/%Y:%H:%M:%S +0000]",localtime(&now));
-    if (0 == req->status)
-	req->status = 400; /* bad request */
-    if (400 == req->status) {
-	fprintf(logfh,"%s - - %s \"-\" 400 %d\n",
-		req->peerhost,
-		timestamp,
-		req->bc);
-    } else {
-	fprintf(logfh,"%s - - %s \"%s %s HTTP/%d.%d\" %d %d\n",
-		req->peerhost,
-		timestamp,
-		req->type,
-		req->uri,
-		req->major,
-		req->minor,
-		req->status,
-		req->bc);
-    }
-    if (flushlog)
-	fflush(logfh);
-    DO_UNLOCK(lock_logfile);
-}
-
 /*
  * loglevel usage
  *   ERR    : fatal errors (which are followed by exit(1))
@@ -366,323 +400,703 @@ xerror(int loglevel, char *txt, char *peerhost)
     }	
 }
 
+/* peer address, formatted on first use */
+char*
+req_peerhost(struct REQUEST *req)
+{
+    if (req->peerhost[0])
+	return req->peerhost;
+    if (0 == req->peer_length) {
+	req->peer_length = sizeof(req->peer);
+	if (-1 == getpeername(req->fd,(struct sockaddr*)&req->peer,
+			      &req->peer_length)) {
+	    req->peer_length = 0;
+	    strcpy(req->peerhost,"?");
+	    return req->peerhost;
+	}
+    }
+    if (0 != getnameinfo((struct sockaddr*)&req->peer,req->peer_length,
+			 req->peerhost,MAX_HOST,req->peerserv,MAX_MISC,
+			 NI_NUMERICHOST | NI_NUMERICSERV))
+	strcpy(req->peerhost,"?");
+    return req->peerhost;
+}
+
 /* ---------------------------------------------------------------------- */
 /* main loop                                                              */
 
-static void*
-mainloop(void *thread_arg)
+/* request and response buffers are attached on demand, connections
+   idling in keepalive state are kept small this way */
+static int
+attach_buffers(struct EVLOOP *loop, struct REQUEST *req)
 {
-    struct REQUEST *conns = NULL;
-    int curr_conn = 0;
+    if (NULL != req->buf)
+	return 0;
+    if (NULL == (req->buf = pool_get(&loop->bufs))) {
+	if (debug)
+	    fprintf(stderr,"%03d: oom\n",req->fd);
+	return -1;
+    }
+    req->hreq  = req->buf->hreq;
+    req->hres  = req->buf->hres;
+    req->uri   = req->buf->uri;
+    req->path  = req->buf->path;
+    req->query = req->buf->query;
+    req->hreq[0]  = 0;
+    req->hres[0]  = 0;
+    req->uri[0]   = 0;
+    req->path[0]  = 0;
+    req->query[0] = 0;
+    return 0;
+}
 
-    struct REQUEST      *req,*prev,*tmp;
-    struct timeval      tv;
-    int                 max;
-    fd_set              rd,wr;
+static void
+release_cgibuf(struct EVLOOP *loop, struct REQUEST *req)
+{
+    if (NULL == req->cgibuf)
+	return;
+    pool_put(&loop->cgibufs,req->cgibuf);
+    req->cgibuf = NULL;
+}
 
-    for (;!termsig;) {
-	if (got_sighup) {
-	    if (NULL != logfile && 0 != strcmp(logfile,"-")) {
-		if (debug)
-		    fprintf(stderr,"got SIGHUP, reopen logfile %s\n",logfile);
-		DO_LOCK(lock_logfile);
-		if (logfh)
-		    fclose(logfh);
-		if (NULL == (logfh = fopen(logfile,"a")))
-		    xperror(LOG_WARNING,"reopen access log",NULL);
-		else
-		    close_on_exec(fileno(logfh));
-		DO_UNLOCK(lock_logfile);
-	    }
-	    got_sighup = 0;
+static void
+release_buffers(struct EVLOOP *loop, struct REQUEST *req)
+{
+    release_cgibuf(loop,req);
+    if (NULL == req->buf)
+	return;
+    pool_put(&loop->bufs,req->buf);
+    req->buf   = NULL;
+    req->hreq  = NULL;
+    req->hres  = NULL;
+    req->uri   = NULL;
+    req->path  = NULL;
+    req->query = NULL;
+}
+
+static void process_request(struct EVLOOP *loop, struct REQUEST *req);
+
+/* fd is an accepted, non-blocking connection; peer may be unknown */
+static struct REQUEST*
+new_request(struct EVLOOP *loop, int fd,
+	    struct sockaddr_storage *peer, socklen_t peer_length)
+{
+    struct REQUEST *req;
+
+    req = pool_get(&loop->reqs);
+    if (NULL == req) {
+	if (debug)
+	    fprintf(stderr,"oom\n");
+	return NULL;
+    }
+    if (-1 == attach_buffers(loop,req)) {
+	pool_put(&loop->reqs,req);
+	return NULL;
+    }
+    req->fd = fd;
+    if (peer) {
+	memcpy(&req->peer,peer,peer_length);
+	req->peer_length = peer_length;
+    }
+    req->cors = cors;
+    req->bfd = -1;
+    req->cgipipe = -1;
+    req->state = STATE_READ_HEADER;
+    req->ping = now;
+    req->loop = loop;
+    req->next = loop->conns;
+    if (loop->conns)
+	loop->conns->prev = req;
+    loop->conns = req;
+    loop->nconns++;
+    CONN_ADD(1);
+    if (debug)
+	fprintf(stderr,"%03d: new request (%d), from %s\n",
+		req->fd,loop->nconns,req_peerhost(req));
+#ifdef USE_SSL
+    if (with_ssl) {
+	open_ssl_session(req);
+	req->state = STATE_TLS_HANDSHAKE;
+	req->ssl_want = EV_READ;
+    }
+#endif
+    return req;
+}
+
+/* drain the listen queue, up to ACCEPT_BATCH connections per wakeup */
+static void
+accept_requests(struct EVLOOP *loop)
+{
+    struct sockaddr_storage peer;
+    struct REQUEST *req;
+    socklen_t peer_length;
+    int i,fd;
+
+    for (i = 0; i < ACCEPT_BATCH && conn_total < max_conn; i++) {
+	peer_length = sizeof(peer);
+#ifdef SOCK_NONBLOCK
+	fd = accept4(loop->slisten,(struct sockaddr*)&peer,&peer_length,
+		     SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	fd = accept(loop->slisten,(struct sockaddr*)&peer,&peer_length);
+#endif
+	if (-1 == fd) {
+	    if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno &&
+		ECONNABORTED != errno)
+		xperror(LOG_WARNING,"accept",NULL);
+	    break;
 	}
-	FD_ZERO(&rd);
-	FD_ZERO(&wr);
-	max = 0;
-	/* add listening socket */
-	if (curr_conn < max_conn) {
-	    FD_SET(slisten,&rd);
-	    max = slisten;
+#ifndef SOCK_NONBLOCK
+	close_on_exec(fd);
+	fcntl(fd,F_SETFL,O_NONBLOCK);
+#endif
+	if (NULL == (req = new_request(loop,fd,&peer,peer_length))) {
+	    close(fd);
+	    break;
 	}
-	/* add connection sockets */
-	for (req = conns; req != NULL; req = req->next) {
-	    switch (req->state) {
-	    case STATE_KEEPALIVE:
-	    case STATE_READ_HEADER:
-		FD_SET(req->fd,&rd);
-		if (req->fd > max)
-		    max = req->fd;
-		break;
-	    case STATE_WRITE_HEADER:
-	    case STATE_WRITE_BODY:
-	    case STATE_WRITE_FILE:
-	    case STATE_WRITE_RANGES:
-	    case STATE_CGI_BODY_OUT:
-		FD_SET(req->fd,&wr);
+	process_request(loop,req);
+    }
+}
+
 #ifdef USE_SSL
-		if (with_ssl)
-		    FD_SET(req->fd,&rd);
+static void
+tls_handshake_done(struct REQUEST *req)
+{
+    if (0 == req->ssl_want)
+	req->state = STATE_READ_HEADER;
+    else if (-1 == req->ssl_want)
+	req->state = STATE_CLOSE;
+    else
+	req->state = STATE_TLS_HANDSHAKE;
+}
+
+/* next handshake step.  A handshake thread gets the request if there
+   is one, it is parked meanwhile: no events, no timer, process_request()
+   leaves it alone until it comes back via ssl_offload_done(). */
+static void
+tls_handshake(struct EVLOOP *loop, struct REQUEST *req)
+{
+    req->state = STATE_TLS_OFFLOAD;
+    ev_update(loop,req);
+    timer_del(&loop->timers,req);
+    if (0 == ssl_offload(loop,req))
+	return;
+    req->ssl_want = ssl_handshake(req);
+    tls_handshake_done(req);
+}
+
+static void
+tls_handshakes_back(struct EVLOOP *loop)
+{
+    struct REQUEST *req,*next;
+
+    for (req = ssl_offload_done(loop); req != NULL; req = next) {
+	next = req->ssl_next;
+	tls_handshake_done(req);
+	req->ping = now;
+	process_request(loop,req);
+    }
+}
 #endif
-		if (req->fd > max)
-		    max = req->fd;
-		break;
-	    case STATE_CGI_HEADER:
-	    case STATE_CGI_BODY_IN:
-		FD_SET(req->cgipipe,&rd);
-		if (req->cgipipe > max)
-		    max = req->cgipipe;
+
+/* directories read by the scan threads, see get_dir() */
+static void
+dir_scans_back(struct EVLOOP *loop)
+{
+    struct REQUEST *req,*next;
+
+    for (req = ls_scan_done(loop); req != NULL; req = next) {
+	next = req->ls_next;
+	dir_request(req);
+	if (req->state == STATE_WRITE_HEADER && !ev_sends(loop,req))
+	    write_request(req);
+	req->ping = now;
+	process_request(loop,req);
+    }
+}
+
+static void
+handle_request(struct EVLOOP *loop, struct REQUEST *req, int flags)
+{
+    switch (req->state) {
+#ifdef USE_SSL
+    case STATE_TLS_HANDSHAKE:
+	if (flags) {
+	    tls_handshake(loop,req);
+	    req->ping = now;
+	}
+	break;
+#endif
+    case STATE_KEEPALIVE:
+    case STATE_READ_HEADER:
+	if (flags & EV_READ) {
+	    if (-1 == attach_buffers(loop,req)) {
+		req->state = STATE_CLOSE;
 		break;
 	    }
+	    req->state = STATE_READ_HEADER;
+	    read_request(req,0);
+	    req->ping = now;
 	}
-	/* go! */
-	tv.tv_sec  = keepalive_time;
-	tv.tv_usec = 0;
-	if (-1 == select(max+1,&rd,&wr,NULL,(curr_conn > 0) ? &tv : NULL)) {
-	    if (errno == EINTR) {
-		if (debug)
-		    fprintf(stderr,"select: interrupted by signal\n");
-		continue;
-	    }
-	    if (debug)
-		perror("select");
-	    continue;
+	break;
+    case STATE_WRITE_HEADER:
+    case STATE_WRITE_BODY:
+    case STATE_WRITE_FILE:
+    case STATE_WRITE_RANGES:
+    case STATE_WRITE_LISTING:
+    case STATE_CGI_BODY_OUT:
+	if (flags & EV_WRITE) {
+	    write_request(req);
+	    req->ping = now;
 	}
-	now = time(NULL);
-
-	/* new connection ? */
-	if (FD_ISSET(slisten,&rd)) {
-	    req = malloc(sizeof(struct REQUEST));
-	    if (NULL == req) {
-		/* oom: let the request sit in the listen queue */
-		if (debug)
-		    fprintf(stderr,"oom\n");
-	    } else {
-		memset(req,0,sizeof(struct REQUEST));
-		if (-1 == (req->fd = accept(slisten,NULL,NULL))) {
-		    if (EAGAIN != errno)
-			xperror(LOG_WARNING,"accept",NULL);
-		    free(req);
-		} else {
-		    close_on_exec(req->fd);
-		    fcntl(req->fd,F_SETFL,O_NONBLOCK);
-		    req->cors = cors;
-		    req->bfd = -1;
-		    req->cgipipe = -1;
-		    req->state = STATE_READ_HEADER;
-		    req->ping = now;
-		    req->next = conns;
-		    conns = req;
-		    curr_conn++;
-		    if (debug)
-			fprintf(stderr,"%03d: new request (%d)\n",req->fd,curr_conn);
 #ifdef USE_SSL
-		    if (with_ssl)
-			open_ssl_session(req);
+	else if (with_ssl && (flags & EV_READ)) {
+	    write_request(req);
+	    req->ping = now;
+	}
 #endif
-		    socklen_t peer_length = sizeof(req->peer);
-		    if (-1 == getpeername(req->fd,(struct sockaddr*)&(req->peer),&peer_length)) {
-			xperror(LOG_WARNING,"getpeername",NULL);
-			req->state = STATE_CLOSE;
-		    }
-		    getnameinfo((struct sockaddr*)&req->peer,peer_length,
-				req->peerhost,64,req->peerserv,8,
-				NI_NUMERICHOST | NI_NUMERICSERV);
-		    if (debug)
-			fprintf(stderr,"%03d: connect from (%s)\n",
-				req->fd,req->peerhost);
-		}
-	    }
+	break;
+    case STATE_CGI_HEADER:
+	if (flags & EV_READ) {
+	    cgi_read_header(req);
+	    req->ping = now;
 	}
+	break;
+    case STATE_CGI_BODY_IN:
+	if (flags & EV_READ) {
+	    write_request(req);
+	    req->ping = now;
+	}
+	break;
+    }
+}
 
-	/* check active connections */
-	for (req = conns, prev = NULL; req != NULL;) {
-	    /* handle I/O */
-	    switch (req->state) {
-	    case STATE_KEEPALIVE:
-	    case STATE_READ_HEADER:
-		if (FD_ISSET(req->fd,&rd)) {
-		    req->state = STATE_READ_HEADER;
-		    read_request(req,0);
-		    req->ping = now;
-		}
-		break;
-	    case STATE_WRITE_HEADER:
-	    case STATE_WRITE_BODY:
-	    case STATE_WRITE_FILE:
-	    case STATE_WRITE_RANGES:
-	    case STATE_CGI_BODY_OUT:
-		if (FD_ISSET(req->fd,&wr)) {
-		    write_request(req);
-		    req->ping = now;
-		}
+/* the engine may still use the buffers (uring recv/sendmsg), so
+   this waits for EV_RELEASE if ev_forget() says so */
+static void
+free_request(struct EVLOOP *loop, struct REQUEST *req)
+{
+    fcache_close(req);
+    ls_free(req);
+    if (req->dir)
+	free_dir(req->dir);
+    release_buffers(loop,req);
+    pool_put(&loop->reqs,req);
+}
+
+static void
+close_request(struct EVLOOP *loop, struct REQUEST *req)
+{
+    int busy;
+
+    if (logfile && req->buf && (req->status || req->hdata || !req->keep_alive))
+	/* skip idle keepalive connections, already logged */
+	access_log(req);
+    /* cleanup */
+    busy = ev_forget(loop,req);
+    timer_del(&loop->timers,req);
 #ifdef USE_SSL
-		if (with_ssl && FD_ISSET(req->fd,&rd)) {
-		    write_request(req);
-		    req->ping = now;
-		}
+    if (with_ssl)
+	close_ssl_session(req);
 #endif
-		break;
-	    case STATE_CGI_HEADER:
-		if (FD_ISSET(req->cgipipe,&rd)) {
-		    cgi_read_header(req);
-		    req->ping = now;
-		}
-		break;
-	    case STATE_CGI_BODY_IN:
-		if (FD_ISSET(req->cgipipe,&rd)) {
-		    write_request(req);
-		    req->ping = now;
-		}
-		break;
-	    }
+    close(req->fd);
+    if (req->cgipipe != -1)
+	close(req->cgipipe);
+    if (req->cgipid)
+	kill(req->cgipid,SIGTERM);
+    loop->nconns--;
+    CONN_ADD(-1);
+    if (debug)
+	fprintf(stderr,"%03d: done (%d)\n",req->fd,loop->nconns);
+    /* unlink from list */
+    if (req->prev)
+	req->prev->next = req->next;
+    else
+	loop->conns = req->next;
+    if (req->next)
+	req->next->prev = req->prev;
+    /* free memory  */
+    if (req->r_start) free(req->r_start);
+    if (req->r_end)   free(req->r_end);
+    if (req->r_head)  free(req->r_head);
+    if (req->r_hlen)  free(req->r_hlen);
+    list_free(&req->header);
+    if (!busy)
+	free_request(loop,req);
+}
 
-	    /* check timeouts */
-	    if (req->state == STATE_KEEPALIVE) {
-		if (now > req->ping + keepalive_time ||
-		    curr_conn > max_conn * 9 / 10) {
-		    if (debug)
-			fprintf(stderr,"%03d: keepalive timeout\n",req->fd);
-		    req->state = STATE_CLOSE;
-		}
-	    } else {
-		if (now > req->ping + timeout) {
-		    if (req->state == STATE_READ_HEADER) {
-			mkerror(req,408,0);
-		    } else {
-			xerror(LOG_INFO,"network timeout",req->peerhost);
-			req->state = STATE_CLOSE;
-		    }
-		}
-	    }
+/* move the request along after I/O, update event registration */
+static void
+process_request(struct EVLOOP *loop, struct REQUEST *req)
+{
+    if (req->state == STATE_TLS_OFFLOAD || req->state == STATE_LS_SCAN)
+	/* owned by a handshake or scan thread */
+	return;
 
-	    /* header parsing */
+    /* header parsing */
 header_parsing:
-	    if (req->state == STATE_PARSE_HEADER) {
-		parse_request(req);
-		if (req->state == STATE_WRITE_HEADER)
-		    write_request(req);
-	    }
+    if (req->state == STATE_PARSE_HEADER) {
+	parse_request(req);
+	if (req->cgipipe != -1 && NULL == req->cgibuf &&
+	    NULL == (req->cgibuf = pool_get(&loop->cgibufs)))
+	    req->state = STATE_CLOSE;
+	if (req->state == STATE_WRITE_HEADER && !ev_sends(loop,req))
+	    /* right away, unless the engine batches it */
+	    write_request(req);
+    }
 
-	    /* handle finished requests */
-	    if (req->state == STATE_FINISHED && !req->keep_alive)
-		req->state = STATE_CLOSE;
-	    if (req->state == STATE_FINISHED) {
-		if (logfh)
-		    access_log(req,now);
-		/* cleanup */
-		req->auth[0]       = 0;
-		req->if_modified   = NULL;
-		req->if_unmodified = NULL;
-		req->if_range      = NULL;
-		req->range_hdr     = NULL;
-		req->ranges        = 0;
-		if (req->r_start) { free(req->r_start); req->r_start = NULL; }
-		if (req->r_end)   { free(req->r_end);   req->r_end   = NULL; }
-		if (req->r_head)  { free(req->r_head);  req->r_head  = NULL; }
-		if (req->r_hlen)  { free(req->r_hlen);  req->r_hlen  = NULL; }
-		list_free(&req->header);
-		memset(req->mtime,   0, sizeof(req->mtime));
-
-		if (req->bfd != -1) {
-		    close(req->bfd);
-		    req->bfd  = -1;
-		}
-		if (req->cgipipe != -1) {
-		    close(req->cgipipe);
-		    req->cgipipe  = -1;
-		}
-		if (req->cgipid) {
-		    kill(req->cgipid,SIGTERM);
-		    req->cgipid = 0;
-		}
-		req->body      = NULL;
-		req->written   = 0;
-		req->head_only = 0;
-		req->rh        = 0;
-		req->rb        = 0;
-		if (req->dir) {
-		    free_dir(req->dir);
-		    req->dir = NULL;
-		}
-		req->hostname[0] = 0;
-		req->path[0]     = 0;
-		req->query[0]    = 0;
-
-		if (req->hdata == req->lreq) {
-		    /* ok, wait for the next one ... */
-		    if (debug)
-			fprintf(stderr,"%03d: keepalive wait\n",req->fd);
-		    req->state = STATE_KEEPALIVE;
-		    req->hdata = 0;
-		    req->lreq  = 0;
+    /* handle finished requests */
+    if (req->state == STATE_FINISHED && !req->keep_alive)
+	req->state = STATE_CLOSE;
+    if (req->state == STATE_FINISHED) {
+	if (logfile)
+	    access_log(req);
+	/* cleanup */
+	req->auth[0]       = 0;
+	req->if_modified   = NULL;
+	req->if_unmodified = NULL;
+	req->if_range      = NULL;
+	req->if_match      = NULL;
+	req->if_none_match = NULL;
+	req->range_hdr     = NULL;
+	req->ranges        = 0;
+	req->accept_enc    = 0;
+	req->ls_format     = LS_HTML;
+	req->encoding      = NULL;
+	req->vary          = 0;
+	if (req->r_start) { free(req->r_start); req->r_start = NULL; }
+	if (req->r_end)   { free(req->r_end);   req->r_end   = NULL; }
+	if (req->r_head)  { free(req->r_head);  req->r_head  = NULL; }
+	if (req->r_hlen)  { free(req->r_hlen);  req->r_hlen  = NULL; }
+	list_free(&req->header);
+	memset(req->mtime,   0, sizeof(req->mtime));
+	req->etag[0]       = 0;
+
+	fcache_close(req);
+	ls_free(req);
+	if (req->cgipipe != -1) {
+	    ev_forget(loop,req);
+	    close(req->cgipipe);
+	    req->cgipipe  = -1;
+	}
+	if (req->cgipid) {
+	    kill(req->cgipid,SIGTERM);
+	    req->cgipid = 0;
+	}
+	release_cgibuf(loop,req);
+	req->status    = 0;
+	req->bc        = 0;
+	req->body      = NULL;
+	req->written   = 0;
+	req->head_only = 0;
+	req->rh        = 0;
+	req->rb        = 0;
+	if (req->dir) {
+	    free_dir(req->dir);
+	    req->dir = NULL;
+	}
+	req->hostname[0] = 0;
+	req->path[0]     = 0;
+	req->query[0]    = 0;
+
+	if (req->hdata == req->lreq) {
+	    /* ok, wait for the next one ... */
+	    if (debug)
+		fprintf(stderr,"%03d: keepalive wait\n",req->fd);
+	    req->state = STATE_KEEPALIVE;
+	    req->hdata = 0;
+	    req->lreq  = 0;
+	    req->hscan = 0;
+	    release_buffers(loop,req);
 #ifdef TCP_CORK
-		    if (1 == req->tcp_cork) {
-			req->tcp_cork = 0;
-			if (debug)
-			    fprintf(stderr,"%03d: tcp_cork=%d\n",req->fd,req->tcp_cork);
-			setsockopt(req->fd,SOL_TCP,TCP_CORK,&req->tcp_cork,sizeof(int));
-		    }
-#endif
-		} else {
-		    /* there is a pipelined request in the queue ... */
-		    if (debug)
-			fprintf(stderr,"%03d: keepalive pipeline\n",req->fd);
-		    req->state = STATE_READ_HEADER;
-		    memmove(req->hreq,req->hreq+req->lreq,
-			    req->hdata-req->lreq);
-		    req->hdata -= req->lreq;
-		    req->lreq  =  0;
-		    read_request(req,1);
-		    goto header_parsing;
-		}
+	    if (1 == req->tcp_cork) {
+		req->tcp_cork = 0;
+		if (debug)
+		    fprintf(stderr,"%03d: tcp_cork=%d\n",req->fd,req->tcp_cork);
+		setsockopt(req->fd,SOL_TCP,TCP_CORK,&req->tcp_cork,sizeof(int));
 	    }
+#endif
+	} else {
+	    /* there is a pipelined request in the queue ... */
+	    if (debug)
+		fprintf(stderr,"%03d: keepalive pipeline\n",req->fd);
+	    req->state = STATE_READ_HEADER;
+	    memmove(req->hreq,req->hreq+req->lreq,
+		    req->hdata-req->lreq);
+	    req->hdata -= req->lreq;
+	    req->lreq  =  0;
+	    req->hscan =  0;
+	    read_request(req,1);
+	    goto header_parsing;
+	}
+    }
+
+    /* connections to close */
+    if (req->state != STATE_CLOSE && -1 == ev_update(loop,req))
+	req->state = STATE_CLOSE;
+    if (req->state == STATE_CLOSE) {
+	close_request(loop,req);
+	return;
+    }
+    if (req->state == STATE_LS_SCAN) {
+	/* parked by get_dir(), no timeout meanwhile */
+	timer_del(&loop->timers,req);
+	return;
+    }
+
+    /* (re-)arm timeout */
+    timer_set(&loop->timers, req, req->ping + 1 +
+	      (req->state == STATE_KEEPALIVE ? keepalive_time : timeout));
+}
+
+static void
+expire_requests(struct EVLOOP *loop)
+{
+    struct REQUEST *req,*next;
+
+    for (req = timer_expire(&loop->timers,now); req != NULL; req = next) {
+	next = req->t_next;
+	req->t_next = NULL;
+	if (req->state == STATE_KEEPALIVE) {
+	    if (debug)
+		fprintf(stderr,"%03d: keepalive timeout\n",req->fd);
+	    req->state = STATE_CLOSE;
+	} else if (req->state == STATE_READ_HEADER) {
+	    mkerror(req,408,0);
+	    req->ping = now;
+	} else {
+	    xerror(LOG_INFO,"network timeout",req_peerhost(req));
+	    req->state = STATE_CLOSE;
+	}
+	process_request(loop,req);
+    }
+}
+
+/* running out of connections -- drop idle keepalive ones */
+static void
+close_idle(struct EVLOOP *loop)
+{
+    struct REQUEST *req,*next;
+
+    for (req = loop->conns; req != NULL; req = next) {
+	next = req->next;
+	if (req->state != STATE_KEEPALIVE)
+	    continue;
+	if (debug)
+	    fprintf(stderr,"%03d: keepalive close (busy)\n",req->fd);
+	req->state = STATE_CLOSE;
+	process_request(loop,req);
+    }
+}
+
+/* memory usage by connection state, and the pools it comes from */
+static void
+loop_stats(struct EVLOOP *loop, char *who)
+{
+    static char *names[] = { "read", "write", "cgi", "keepalive", "tls" };
+    struct REQUEST *req;
+    unsigned long bytes[5];
+    int count[5],i;
+    char msg[256];
+    int len;
+
+    memset(count,0,sizeof(count));
+    memset(bytes,0,sizeof(bytes));
+    for (req = loop->conns; req != NULL; req = req->next) {
+	switch (req->state) {
+	case STATE_KEEPALIVE:
+	    i = 3;
+	    break;
+	case STATE_READ_HEADER:
+	case STATE_PARSE_HEADER:
+	case STATE_LS_SCAN:
+	    i = 0;
+	    break;
+	case STATE_CGI_HEADER:
+	case STATE_CGI_BODY_IN:
+	case STATE_CGI_BODY_OUT:
+	    i = 2;
+	    break;
+	case STATE_TLS_HANDSHAKE:
+	case STATE_TLS_OFFLOAD:
+	    i = 4;
+	    break;
+	default:
+	    i = 1;
+	    break;
+	}
+	count[i]++;
+	bytes[i] += sizeof(struct REQUEST);
+	if (req->buf)
+	    bytes[i] += sizeof(struct REQBUF);
+	if (req->cgibuf)
+	    bytes[i] += MAX_HEADER+1;
+    }
+    len = snprintf(msg,sizeof(msg),"%s: %d conns",who,loop->nconns);
+    for (i = 0; i < 5; i++)
+	len += snprintf(msg+len,sizeof(msg)-len,", %s %d (%lu kB)",
+			names[i],count[i],bytes[i] / 1024);
+    xerror(LOG_NOTICE,msg,NULL);
+    pool_stats(&loop->reqs,who);
+    pool_stats(&loop->bufs,who);
+    pool_stats(&loop->cgibufs,who);
+    log_stats(who);
+}
 
-	    /* connections to close */
-	    if (req->state == STATE_CLOSE) {
-		if (logfh)
-		    access_log(req,now);
-		/* cleanup */
-		close(req->fd);
+static void
+pin_worker(struct WORKER *w)
+{
+#if defined(__linux__) && defined(USE_THREADS)
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu,&set);
+    if (0 != pthread_setaffinity_np(pthread_self(),sizeof(set),&set))
+	xerror(LOG_WARNING,"can't pin thread to cpu",NULL);
+# ifdef SO_INCOMING_CPU
+    /* prefer connections which arrive on our cpu */
+    if (0 == w->id || w->slisten != slisten)
+	setsockopt(w->slisten,SOL_SOCKET,SO_INCOMING_CPU,&w->cpu,sizeof(int));
+# endif
+#endif
+}
+
+static void*
+mainloop(void *thread_arg)
+{
+    struct WORKER       *w = thread_arg;
+    struct EVLOOP       loop;
+    struct REQUEST      *req;
+    time_t              checked = 0;
+    int                 i,n,accepting,wait,stats = got_sigusr1;
+    char                who[32];
+
+    if (w && -1 != w->cpu)
+	pin_worker(w);
+    ev_init(&loop, w ? w->slisten : slisten);
+    now = time(NULL);
+    timer_init(&loop.timers, now);
+    pool_init(&loop.reqs, "request", sizeof(struct REQUEST),
+	      sizeof(struct REQUEST));
+    pool_init(&loop.bufs, "buffer", sizeof(struct REQBUF), 0);
+    pool_init(&loop.cgibufs, "cgi", MAX_HEADER+1, 0);
+    snprintf(who, sizeof(who), "worker %d", w ? w->id : 0);
+#ifdef USE_THREADS
+    /* scan and handshake threads hand connections back */
+    ev_wakeup(&loop);
+#endif
+    if (debug && w)
+	fprintf(stderr,"worker %d: listen %d, cpu %d\n",
+		w->id,w->slisten,w->cpu);
+    for (;!termsig;) {
+	if (got_sighup) {
+	    log_reopen();
+	    got_sighup = 0;
+	}
+	if (stats != got_sigusr1) {
+	    stats = got_sigusr1;
+	    loop_stats(&loop, who);
+	    if (NULL == w || 0 == w->id) {
+		fcache_stats();
 #ifdef USE_SSL
 		if (with_ssl)
-		    SSL_free(req->ssl_s);
+		    ssl_stats();
 #endif
-		if (req->bfd != -1)
-		    close(req->bfd);
-		if (req->cgipipe != -1)
-		    close(req->cgipipe);
-		if (req->cgipid)
-		    kill(req->cgipid,SIGTERM);
-		if (req->dir)
-		    free_dir(req->dir);
-		curr_conn--;
+	    }
+	}
+
+	/* go! */
+	accepting = conn_total < max_conn;
+	ev_listen(&loop, accepting ? max_conn - conn_total : 0);
+	wait = timer_wait(&loop.timers);
+	if (!accepting && (wait < 0 || wait > 1000))
+	    /* other threads may free up connections */
+	    wait = 1000;
+	n = ev_wait(&loop, wait);
+	if (-1 == n) {
+	    if (errno == EINTR) {
 		if (debug)
-		    fprintf(stderr,"%03d: done (%d)\n",req->fd,curr_conn);
-		/* unlink from list */
-		tmp = req;
-		if (prev == NULL) {
-		    conns = req->next;
-		    req = conns;
-		} else {
-		    prev->next = req->next;
-		    req = req->next;
+		    fprintf(stderr,"%s: interrupted by signal\n",
+			    ev_engine_name(&loop));
+		continue;
+	    }
+	    if (debug)
+		perror(ev_engine_name(&loop));
+	    continue;
+	}
+	now = time(NULL);
+
+	/* handle ready connections, new ones included */
+	for (i = 0; i < n; i++) {
+	    req = loop.ready[i].req;
+	    if (NULL == req) {
+		if (-1 == loop.ready[i].fd) {
+		    accept_requests(&loop);
+		    continue;
+		}
+		/* already accepted by the event engine */
+		if (conn_total >= max_conn) {
+		    /* the engine had more accepts in flight than we
+		       have room for now, same limit as accept_requests() */
+		    close(loop.ready[i].fd);
+		    continue;
+		}
+		req = new_request(&loop,loop.ready[i].fd,NULL,0);
+		if (NULL == req) {
+		    close(loop.ready[i].fd);
+		    continue;
 		}
-		/* free memory  */
-		if (tmp->r_start) free(tmp->r_start);
-		if (tmp->r_end)   free(tmp->r_end);
-		if (tmp->r_head)  free(tmp->r_head);
-		if (tmp->r_hlen)  free(tmp->r_hlen);
-		list_free(&tmp->header);
-		free(tmp);
+	    } else if (loop.ready[i].flags & EV_RELEASE) {
+		free_request(&loop,req);
+		continue;
 	    } else {
-		prev = req;
-		req = req->next;
+		handle_request(&loop,req,loop.ready[i].flags);
 	    }
+	    process_request(&loop,req);
 	}
+#ifdef USE_SSL
+	if (with_ssl)
+	    tls_handshakes_back(&loop);
+#endif
+	dir_scans_back(&loop);
+
+	/* timeouts */
+	expire_requests(&loop);
+	if (checked != now && conn_total > max_conn * 9 / 10)
+	    close_idle(&loop);
+	checked = now;
+
+	/* without threads nobody else writes the access log */
+	log_flush();
     }
+    ev_free(&loop);
     return NULL;
 }
 
+#ifdef REUSEPORT_LB
+/* another listening socket for the SO_REUSEPORT group, one per thread,
+   so the kernel spreads connections instead of waking all threads */
+static int
+open_listen(struct addrinfo *res, struct sockaddr_storage *ss, int ss_len)
+{
+    int fd, opt = 1;
+
+    if (-1 == (fd = socket(res->ai_family, res->ai_socktype,
+			   res->ai_protocol)))
+	return -1;
+    close_on_exec(fd);
+    setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&opt,sizeof(opt));
+    setsockopt(fd,SOL_SOCKET,SO_REUSEPORT,&opt,sizeof(opt));
+    fcntl(fd,F_SETFL,O_NONBLOCK);
+    if (-1 == bind(fd, (struct sockaddr*)ss, ss_len) ||
+	-1 == listen(fd, 2*max_conn)) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+#endif
+
 /* ---------------------------------------------------------------------- */
 
 #ifdef BUILD_AS_MAIN
@@ -692,7 +1106,8 @@ main(int argc, char *argv[])
     struct sigaction         act,old;
     struct addrinfo          ask,*res;
     struct sockaddr_storage  ss;
-    int c, opt, rc, ss_len, pid=0, v4 = 1, v6 = 1;
+    struct rlimit            rlim;
+    int c, i, opt, rc, ss_len, pid=0, v4 = 1, v6 = 1, ncpus;
     int uid,euid;
     char host[INET6_ADDRSTRLEN+1];
     char serv[16];
@@ -712,8 +1127,8 @@ main(int argc, char *argv[])
     
     /* parse options */
     for (;;) {
-	if (-1 == (c = getopt(argc,argv,"hvsdF46jS"
-			      "O:r:R:f:p:n:N:i:t:c:a:u:g:l:L:m:y:b:k:e:x:C:P:~:")))
+	if (-1 == (c = getopt(argc,argv,"hvsdF46jSA"
+			      "O:r:R:f:p:n:N:i:t:c:a:D:K:T:M:Z:u:g:l:L:m:y:b:k:e:x:C:P:H:~:E:")))
 	    break;
 	switch (c) {
 	case 'h':
@@ -772,6 +1187,23 @@ main(int argc, char *argv[])
 	case 'a':
 	    max_dircache = atoi(optarg);
 	    break;
+	case 'D':
+	    dircache_max = parse_size(optarg);
+	    break;
+	case 'K':
+	    fcache_max = atoi(optarg);
+	    break;
+	case 'T':
+	    fcache_valid = atoi(optarg);
+	    break;
+	case 'M':
+	    mcache_max = parse_size(optarg);
+	    break;
+#if defined(USE_ZLIB) && defined(USE_THREADS)
+	case 'Z':
+	    zcache_max = parse_size(optarg);
+	    break;
+#endif
 	case 'u':
 	    strncpy(user,optarg,16);
 	    break;
@@ -809,6 +1241,9 @@ main(int argc, char *argv[])
 	case 'y':
 	    nthreads = atoi(optarg);
 	    break;
+	case 'A':
+	    pin_threads = 1;
+	    break;
 #endif
 #ifdef USE_SSL
 	case 'S':
@@ -821,6 +1256,9 @@ main(int argc, char *argv[])
 	    password = strdup(optarg);
 	    memset(optarg,'x',strlen(optarg));
 	    break;
+	case 'H':
+	    ssl_threads = atoi(optarg);
+	    break;
 #endif
 	case 'j':
 	    no_listing = 1;
@@ -828,12 +1266,30 @@ main(int argc, char *argv[])
 	case '~':
 	    userdir = optarg;
 	    break;
+	case 'E':
+	    engine = optarg;
+	    break;
 	default:
 	    exit(1);
 	}
     }
     if (usesyslog)
 	syslog_init();
+    if ((mcache_max > 0 || zcache_max > 0) && 0 == fcache_max)
+	/* the memory caches live in the file cache */
+	fcache_max = 1024;
+
+    /* each connection needs a socket and maybe a file handle,
+     * the file cache keeps some more open */
+    if (0 == getrlimit(RLIMIT_NOFILE,&rlim) &&
+	rlim.rlim_cur != RLIM_INFINITY &&
+	rlim.rlim_cur < (rlim_t)max_conn * 2 + fcache_max + 32) {
+	rlim.rlim_cur = (rlim_t)max_conn * 2 + fcache_max + 32;
+	if (rlim.rlim_max != RLIM_INFINITY && rlim.rlim_cur > rlim.rlim_max)
+	    rlim.rlim_cur = rlim.rlim_max;
+	if (-1 == setrlimit(RLIMIT_NOFILE,&rlim) && debug)
+	    perror("setrlimit");
+    }
 
     /* bind to socket */
     slisten = -1;
@@ -921,9 +1377,48 @@ main(int argc, char *argv[])
         exit(1);
     }
 
+    /* setup worker threads */
+#ifdef USE_THREADS
+    if (nthreads > 1)
+	nworkers = nthreads;
+# ifdef USE_SSL
+    if (ssl_threads < 0)
+	/* one per two event loops */
+	ssl_threads = (nworkers + 1) / 2;
+# endif
+#endif
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1)
+	ncpus = 1;
+    workers = malloc(sizeof(struct WORKER) * nworkers);
+    memset(workers,0,sizeof(struct WORKER) * nworkers);
+    for (i = 0; i < nworkers; i++) {
+	workers[i].id      = i;
+	workers[i].slisten = slisten;
+	workers[i].cpu     = -1;
+#ifdef USE_THREADS
+	if (pin_threads)
+	    workers[i].cpu = i % ncpus;
+#endif
+#ifdef REUSEPORT_LB
+	if (0 == i)
+	    continue;
+	if (uid != euid)
+	    run_as (euid);
+	workers[i].slisten = open_listen(res, &ss, ss_len);
+	if (uid != euid)
+	    run_as (uid);
+	if (-1 == workers[i].slisten) {
+	    xperror(LOG_WARNING,"per-thread listen (sharing socket)",NULL);
+	    workers[i].slisten = slisten;
+	}
+#endif
+    }
+
     /* init misc stuff */
     init_mime(mimetypes,"text/plain");
     init_quote();
+    init_fcache();
 #ifdef USE_SSL
     if (with_ssl)
 	init_ssl();
@@ -934,16 +1429,8 @@ main(int argc, char *argv[])
 	run_as (euid);
     fix_ug();
 
-    if (logfile) {
-	if (0 == strcmp(logfile,"-")) {
-	    logfh = stdout;
-	} else {
-	    if (NULL == (logfh = fopen(logfile,"a")))
-		xperror(LOG_WARNING,"open access log",NULL);
-	    else
-		close_on_exec(fileno(logfh));
-	}
-    }
+    if (logfile)
+	log_open();
 
     if (pidfile) {
 	if (-1 == (pid = open(pidfile,O_WRONLY | O_CREAT | O_EXCL, 0600))) {
@@ -1005,30 +1492,34 @@ main(int argc, char *argv[])
     sigaction(SIGCHLD,&act,&old);
     act.sa_handler = catchsig;
     sigaction(SIGHUP,&act,&old);
+    sigaction(SIGUSR1,&act,&old);
     sigaction(SIGTERM,&act,&old);
     /* Handle SIGINT in debug mode or when running in foreground */
     if (debug || dontdetach)
 	sigaction(SIGINT,&act,&old);
 
     /* go! */
+    if (logfile)
+	log_start();
+    fcache_start();
+#ifdef USE_SSL
+    if (with_ssl)
+	ssl_start();
+#endif
 #ifdef USE_THREADS
-    if (nthreads > 1) {
-	int i;
-	threads = malloc(sizeof(pthread_t) * nthreads);
-	for (i = 1; i < nthreads; i++) {
-	    pthread_create(threads+i,NULL,mainloop,threads+i);
-	    pthread_detach(threads[i]);
-	}
+    for (i = 1; i < nworkers; i++) {
+	pthread_create(&workers[i].thread,NULL,mainloop,workers+i);
+	pthread_detach(workers[i].thread);
     }
 #endif
-    mainloop(NULL);
+    mainloop(workers);
     
 #ifdef USE_SSL
     if (with_ssl)
 	SSL_CTX_free(ctx);
 #endif
-    if (logfh)
-	fclose(logfh);
+    if (logfile)
+	log_stop();
     if (pidfile)
 	unlink(pidfile);
     if (debug)
@@ -20,7 +20,6 @@ extern int usesyslog;
 extern int virtualhosts;
 extern char *userpass;
 extern char *cgipath;
-extern time_t now;
 
 /* Function declarations from webfsd.c */
 void init_mime(char *file, char *def);